@@ -1,21 +1,341 @@
 
 #include <vector>
+#include <algorithm>
+#include <stdint.h>
 #include "octree.h"
+#include "octree_pool.h"
+#include "octree_shared.h"
 
 
 typedef long ValueType;
 
+// Vertex of the indexed mesh formats (position and normal interleaved).
+struct MeshVertex {
+    float pos[3];
+    float norm[3];
+};
+
+// Vertex of MESH_QUANTIZED. pos: relative to the chunk origin in
+// 1/MESH_QUANT cells. norm: signed bytes (x,y,z,unused).
+struct MeshVertexQ {
+    int16_t pos[3];
+    int8_t norm[4];
+};
+
+
+// Blocks are shared with the undo history (see OctreeSharedStorage).
+class GLOctree : public Octree<ValueType, OctreeSharedStorage<ValueType> >{
+    typedef OctreeSharedStorage<ValueType> Storage;
+    typedef OctreeCursor<ValueType, Storage> Cursor;
+
+    static const int MESH_CHUNK_LEVEL = 4;
+    static const int MESH_QUANT = 1024;
 
-class GLOctree : public Octree<ValueType>{
     float element_size;
     int vart_num;
     
     std::vector<float> vart_array;
     std::vector<float> norm_array;
 
+    // meshes of make_vartex2, one per chunk. chunk (cx,cy,cz) is
+    // chunks[cx+(cy+cz*chunk_num)*chunk_num].
+    // MESH_TRIANGLES: vart/norm, MESH_INDEXED: verts/index,
+    // MESH_QUANTIZED: qverts/index. Indices are local to the chunk.
+    struct MeshChunk {
+        std::vector<float> vart;
+        std::vector<float> norm;
+        std::vector<MeshVertex> verts;
+        std::vector<MeshVertexQ> qverts;
+        std::vector<uint16_t> index;
+#if _OCTREE_STATS
+        OctreeMeshStats stats;
+        OctreePhaseClock clock;
+#endif
+    };
+    std::vector<MeshChunk> chunks;
+    std::vector<char> dirty;
+    std::vector<int> dirty_chunks;
+    int chunk_level;
+    int chunk_num;
+    long chunk_vart_num;
+    bool chunk_merge;
+    bool all_dirty;
+    int mesh_format;
+    OctreeWorkerPool *pool;
+    // neighbor lookups of make_vartex
+    Cursor nb;
+    // last make_vartex/make_vartex2. Times with _OCTREE_STATS.
+    OctreeMeshStats mesh_stats;
+#if _OCTREE_STATS
+    OctreePhaseClock mesh_clock;
+#endif
+
+    // state kept by the undo history
+    struct State {
+        Storage storage;
+        OctreeOrientation orient;
+        State(const Storage &s, const OctreeOrientation &o) : storage(s), orient(o) {}
+    };
+    OctreeHistory<State> history;
+
+    State state() const {
+        return State(storage, orient);
+    }
+
+    // Whether the tree differs from s. An edit copies the blocks shared
+    // with s on its path, so the roots tell.
+    bool changed(const State &s) const {
+        if (orient != s.orient) return true;
+        Node a = storage.root(), b = s.storage.root();
+        bool ca = storage.hasChild(a), cb = storage.hasChild(b);
+        if (ca && cb) return storage.child(a, 0) != storage.child(b, 0);
+        return ca || cb || storage.value(a) != storage.value(b);
+    }
+
 public:
-    GLOctree(int d = 5, int v=0) : Octree(d,v) {
+    // output of make_vartex2
+    enum {
+        MESH_TRIANGLES = 0, // 6 vertices per quad, flat normals
+        MESH_INDEXED = 1,   // shared corners, MeshVertex + 16 bit indices
+        MESH_QUANTIZED = 2, // shared corners, MeshVertexQ + 16 bit indices
+    };
+
+    GLOctree(int d = 5, int v=0) : Octree(d,v), nb(storage, d) {
         element_size = 2.0f/esize;
+        vart_num = 0;
+        chunk_level = d < MESH_CHUNK_LEVEL ? d : MESH_CHUNK_LEVEL;
+        chunk_num = 0;
+        chunk_vart_num = 0;
+        chunk_merge = true;
+        all_dirty = true;
+        mesh_format = MESH_TRIANGLES;
+        pool = NULL;
+    }
+
+    // Edits mark the chunks they touch for make_vartex2.
+
+    void setValue(long x, long y, long z, ValueType v){
+        if (x<0 || x>=esize || y<0 || y>=esize || z<0 || z>=esize) return;
+        if (getValue(x, y, z) == v) return;
+        history.record(state());
+        Octree::setValue(x, y, z, v);
+        mark_dirty(OctreeBox(x, y, z, 1, 1, 1));
+    }
+
+    template<typename F>
+    OctreeBox applyFunc(const F &f, ValueType v) {
+        State before = state();
+        OctreeBox changed = Octree::applyFunc(f, v);
+        if (!changed.empty()) history.record(before);
+        mark_dirty(changed);
+        return changed;
+    }
+
+    OctreeBox sphere(int x, int y, int z, int r, ValueType v) {
+        return applyFunc(OctreeSphereFunc(x, y, z, r), v);
+    }
+
+    OctreeBox box(int x, int y, int z, int w, int h, int d, ValueType v) {
+        return applyFunc(OctreeBoxFunc(OctreeBox(x, y, z, w, h, d)), v);
+    }
+
+    OctreeBox cube(int cx, int cy, int cz, int size, ValueType v) {
+        return box(cx - size/2, cy - size/2, cz - size/2, size, size, size, v);
+    }
+
+    void scrapeSphere(int x,int y,int z,int r) {
+        sphere(x, y, z, r, 0);
+    }
+
+    template<typename S2, typename Op>
+    OctreeBox combine(const Octree<ValueType, S2> &o, const Op &op) {
+        State before = state();
+        OctreeBox changed = Octree::combine(o, op);
+        if (!changed.empty()) history.record(before);
+        mark_dirty(changed);
+        return changed;
+    }
+
+    template<typename S2, typename F>
+    OctreeBox csg(const Octree<ValueType, S2> &o, const F &f) {
+        return combine(o, OctreeCsgFunc<ValueType, F>(f));
+    }
+
+    template<typename S2>
+    OctreeBox unite(const Octree<ValueType, S2> &o) {
+        return combine(o, OctreeCsgUnion<ValueType>());
+    }
+
+    template<typename S2>
+    OctreeBox intersect(const Octree<ValueType, S2> &o) {
+        return combine(o, OctreeCsgIntersect<ValueType>());
+    }
+
+    template<typename S2>
+    OctreeBox subtract(const Octree<ValueType, S2> &o) {
+        return combine(o, OctreeCsgSubtract<ValueType>());
+    }
+
+    template<typename S2>
+    OctreeBox paste(const Octree<ValueType, S2> &o, ValueType mask = 0) {
+        return combine(o, OctreeCsgPaste<ValueType>(mask));
+    }
+
+    OctreeBox fromDense(long x, long y, long z, long size, const ValueType *data, long sx, long sy, long sz,
+            OctreeWorkerPool *pool = NULL) {
+        State before = state();
+        OctreeBox changed = Octree::fromDense(x, y, z, size, data, sx, sy, sz, pool);
+        if (!changed.empty()) history.record(before);
+        mark_dirty(changed);
+        return changed;
+    }
+
+    OctreeBox fromDense(const ValueType *data, long sx, long sy, long sz, OctreeWorkerPool *pool = NULL) {
+        return fromDense(0, 0, 0, esize, data, sx, sy, sz, pool);
+    }
+
+    OctreeBox setValues(const OctreeEdit<ValueType> *edits, size_t n) {
+        OctreeBatchBuffer b;
+        return setValues(edits, n, b);
+    }
+
+    OctreeBox setValues(const OctreeEdit<ValueType> *edits, size_t n, OctreeBatchBuffer &b) {
+        State before = state();
+        OctreeBox changed = Octree::setValues(edits, n, b);
+        if (!changed.empty()) history.record(before);
+        mark_dirty(changed);
+        return changed;
+    }
+
+    void rotate_z(){
+        rotate(2);
+    }
+
+    void rotate(int axis, int turns = 1){
+        history.record(state());
+        Octree::rotate(axis, turns);
+        all_dirty = true;
+    }
+
+    void mirror(int axis){
+        history.record(state());
+        Octree::mirror(axis);
+        all_dirty = true;
+    }
+
+    void unserialize(const std::vector<char> &buf) {
+        history.record(state());
+        Octree::unserialize(buf);
+        all_dirty = true;
+    }
+
+    // A file that is not read leaves the tree, the history and the
+    // meshes as they are.
+    bool loadVoxf(const char *path) {
+        State before = state();
+        bool ok = Octree::loadVoxf(path);
+        if (changed(before)) {
+            history.record(before);
+            all_dirty = true;
+        }
+        return ok;
+    }
+
+    template<typename Source>
+    bool load(Source &src) {
+        State before = state();
+        bool ok = Octree::load(src);
+        if (changed(before)) {
+            history.record(before);
+            all_dirty = true;
+        }
+        return ok;
+    }
+
+    // Edits between beginEdit() and endEdit() are undone as one step.
+    void beginEdit() {
+        history.begin();
+    }
+    void endEdit() {
+        history.end();
+    }
+
+    // Only the chunks that differ from the current state are remeshed.
+    bool undo() {
+        State s = state();
+        if (!history.undo(s)) return false;
+        restore(s);
+        return true;
+    }
+    bool redo() {
+        State s = state();
+        if (!history.redo(s)) return false;
+        restore(s);
+        return true;
+    }
+    bool canUndo() const {
+        return history.canUndo();
+    }
+    bool canRedo() const {
+        return history.canRedo();
+    }
+
+    // Copy of the current state (O(1)) for readers in other threads.
+    Storage snapshot() const {
+        return storage;
+    }
+
+    // Merges identical subtrees (see OctreeSharedStorage::compact). The
+    // contents, the meshes and the history do not change.
+    OctreeDagStats compact() {
+        return storage.compact();
+    }
+
+    // Faces of a chunk depend on the cells within 1 of it, so the box is
+    // grown by one cell and neighbour chunks on the boundary are marked too.
+    void mark_dirty(const OctreeBox &b){
+        if (all_dirty || b.empty()) return;
+        int x1 = (std::max)(b.x1-1, 0) >> chunk_level, x2 = (std::min)(b.x2, esize-1) >> chunk_level;
+        int y1 = (std::max)(b.y1-1, 0) >> chunk_level, y2 = (std::min)(b.y2, esize-1) >> chunk_level;
+        int z1 = (std::max)(b.z1-1, 0) >> chunk_level, z2 = (std::min)(b.z2, esize-1) >> chunk_level;
+        for (int cz=z1;cz<=z2;cz++) {
+            for (int cy=y1;cy<=y2;cy++) {
+                for (int cx=x1;cx<=x2;cx++) {
+                    int ci = cx+(cy+cz*chunk_num)*chunk_num;
+                    if (!dirty[ci]) {
+                        dirty[ci] = 1;
+                        dirty_chunks.push_back(ci);
+                    }
+                }
+            }
+        }
+    }
+
+    void restore(const State &s){
+        Storage cur = storage;
+        storage = s.storage;
+        if (orient != s.orient) {
+            orient = s.orient;
+            all_dirty = true;
+            return;
+        }
+        mark_changed(storage.root(), cur.root(), 0, 0, 0, depth);
+    }
+
+    // Marks the chunks where trees a and b (same orientation) differ. Shared blocks are
+    // skipped, so this costs as much as the edits between them.
+    void mark_changed(Node a, Node b, int x, int y, int z, int d){
+        bool ca = storage.hasChild(a), cb = storage.hasChild(b);
+        if (ca && cb && d > 0) {
+            if (storage.child(a, 0) == storage.child(b, 0)) return;
+            int half = 1 << (d-1);
+            for (int i=0;i<8;i++) {
+                mark_changed(child(a, i), child(b, i), x+half*(i&1), y+half*((i>>1)&1), z+half*((i>>2)&1), d-1);
+            }
+            return;
+        }
+        if (!ca && !cb && storage.value(a) == storage.value(b)) return;
+        mark_dirty(OctreeBox(x, y, z, 1<<d, 1<<d, 1<<d));
     }
 
     void getPos(int* pos,float x,float y,float z) {
@@ -25,7 +345,15 @@ public:
     }
 
 
+    // neighbor lookup of make_vartex
+    inline ValueType neighbor(int x, int y, int z){
+        OCTREE_PHASE(mesh_clock, mesh_stats.neighbors);
+        OCTREE_STAT(mesh_stats.lookups++);
+        return nb.at(x, y, z);
+    }
+
     void adjust_vart(float *p, int x,int y, int z,int* ff, int offset){
+        OCTREE_PHASE(mesh_clock, mesh_stats.adjust);
 
         //int n = x+(offset%3) + (y+(offset/3)%3)*1024 + (z+(offset/9))*1024*1024;
         
@@ -36,7 +364,7 @@ public:
         for (int i=0;i<8;i++) {
             int dd = offset+d[i];
             if(ff[dd] <0) {
-                ff[dd] = getValue(x+(dd%3), y+(dd/3)%3, z+(dd/9)%3)>0?1:0;
+                ff[dd] = neighbor(x+(dd%3), y+(dd/3)%3, z+(dd/9)%3)>0?1:0;
             }
         }
         
@@ -131,19 +459,19 @@ public:
         c[2]/=l;
     }
 
-    void make_vartex(OctreeNode<ValueType> &elem,int x,int y,int z, int sz) {
-        if (elem.hasChild()) {
+    void make_vartex(Node elem,int x,int y,int z, int sz) {
+        if (storage.hasChild(elem)) {
             int half = sz>>1;
             for (int i=0;i<8;i++) {
                 int dx=0,dy=0,dz=0;
                 if ((i&1) != 0) dx = half;
                 if ((i&2) != 0) dy = half;
                 if ((i&4) != 0) dz = half;
-                make_vartex(elem.child[i],x+dx,y+dy,z+dz,half);
+                make_vartex(child(elem, i),x+dx,y+dy,z+dz,half);
             }
             return;
         }
-        if (elem.value==0) return;
+        if (storage.value(elem)==0) return;
 
         float sq_vart[4][3];
         int ff[27];
@@ -161,7 +489,7 @@ public:
             for (int i=0;i<sz;i++) {
 //                if (vart_num>149000) continue;
                 // z+
-                if (getValue(x+i, y+j, z+sz) <=0) {
+                if (neighbor(x+i, y+j, z+sz) <=0) {
                     //Log.d("Octree","draw "+x+","+y+","+z+" "+(x+i)+","+(y+j)+","+(z+sz));
 
                     int *offset = offset_array[0];
@@ -172,6 +500,7 @@ public:
                         adjust_vart(sq_vart[k], x+i-1,y+j-1,z+sz-1,ff,offset[k]);
                     }
 
+                    OCTREE_PHASE(mesh_clock, mesh_stats.emission);
                     float n[3];
                     norm(n,sq_vart[2],sq_vart[1],sq_vart[0]);
                     for (int k=0;k<6;k++) {
@@ -186,7 +515,7 @@ public:
                 }
 
                 // z-
-                if (getValue(x+i, y+j, z-1) <=0) {
+                if (neighbor(x+i, y+j, z-1) <=0) {
 
                     int *offset = offset_array[1];
                     for (int k=0;k<27;k++) {
@@ -196,6 +525,7 @@ public:
                         adjust_vart(sq_vart[k], x+i-1,y+j-1,z-1,ff,offset[k]);
                     }
 
+                    OCTREE_PHASE(mesh_clock, mesh_stats.emission);
                     float n[3];
                     norm(n,sq_vart[2],sq_vart[1],sq_vart[0]);
                     for (int k=0;k<6;k++) {
@@ -210,7 +540,7 @@ public:
                 }
             
                 // x+
-                if (getValue(x+sz, y+i, z+j) <=0) {
+                if (neighbor(x+sz, y+i, z+j) <=0) {
 
                     int *offset = offset_array[2];
                     for (int k=0;k<27;k++) {
@@ -220,6 +550,7 @@ public:
                         adjust_vart(sq_vart[k], x+sz-1,y+i-1,z+j-1,ff,offset[k]);
                     }
 
+                    OCTREE_PHASE(mesh_clock, mesh_stats.emission);
                     float n[3];
                     norm(n,sq_vart[2],sq_vart[1],sq_vart[0]);
                     for (int k=0;k<6;k++) {
@@ -234,7 +565,7 @@ public:
                 }
 
                 // x-
-                if (getValue(x-1, y+i, z+j) <=0) {
+                if (neighbor(x-1, y+i, z+j) <=0) {
 
                     int* offset = offset_array[3];
                     for (int k=0;k<27;k++) {
@@ -244,6 +575,7 @@ public:
                         adjust_vart(sq_vart[k], x-1,y+i-1,z+j-1,ff,offset[k]);
                     }
 
+                    OCTREE_PHASE(mesh_clock, mesh_stats.emission);
                     float n[3];
                     norm(n,sq_vart[2],sq_vart[1],sq_vart[0]);
                     for (int k=0;k<6;k++) {
@@ -259,7 +591,7 @@ public:
             
             
                 // y+
-                if (getValue(x+j, y+sz, z+i) <=0) {
+                if (neighbor(x+j, y+sz, z+i) <=0) {
                     //Log.d("Octree","draw "+x+","+y+","+z+" "+(x+i)+","+(y+j)+","+(z+sz));
 
                     int* offset = offset_array[4];
@@ -270,6 +602,7 @@ public:
                         adjust_vart(sq_vart[k], x+j-1,y+sz-1,z+i-1,ff,offset[k]);
                     }
                     
+                    OCTREE_PHASE(mesh_clock, mesh_stats.emission);
                     float n[3];
                     norm(n,sq_vart[2],sq_vart[1],sq_vart[0]);
                     for (int k=0;k<6;k++) {
@@ -284,7 +617,7 @@ public:
                 }
 
                 // y-
-                if (getValue(x+i, y-1, z+j) <=0) {
+                if (neighbor(x+i, y-1, z+j) <=0) {
 
                     int* offset = offset_array[5];
                     for (int k=0;k<27;k++) {
@@ -294,6 +627,7 @@ public:
                         adjust_vart(sq_vart[k],x+i-1,y-1,z+j-1,ff,offset[k]);
                     }
 
+                    OCTREE_PHASE(mesh_clock, mesh_stats.emission);
                     float n[3];
                     norm(n,sq_vart[2],sq_vart[1],sq_vart[0]);
                     for (int k=0;k<6;k++) {
@@ -316,63 +650,586 @@ public:
         vart_num = 0;
         vart_array.clear();
         norm_array.clear();
-        make_vartex(element,0,0,0,esize);
-
-        std::cout << "debug v:"<< vart_num << std::endl;
+        chunks.clear();
+        chunk_vart_num = 0;
+        all_dirty = true;
+        nb = cursor();
+        mesh_stats = OctreeMeshStats();
+        {
+            OCTREE_PHASE(mesh_clock, mesh_stats.traversal);
+            make_vartex(storage.root(),0,0,0,esize);
+        }
+        mesh_stats.verts = vart_num;
 
         return vart_num;
     }
 
 
-    long make_vartex2(){
+    static inline int ctz64(uint64_t m){
+#if defined(__GNUC__)
+        return __builtin_ctzll(m);
+#else
+        int n = 0;
+        while (!(m&1)) {m>>=1; n++;}
+        return n;
+#endif
+    }
+
+    // Smoothed vertex at corner i of a row (as adjust_vart). a0,a1: rows j-1,j
+    // of layer c[axis], b0,b1: the same rows of the next layer. Bits i,i+1 of
+    // each row are the 2x2x2 cells around the corner. c: lower cell.
+    // nv: if not NULL, the (unnormalized) gradient from solid to empty.
+    void corner_vart(float *p, float *nv, uint64_t a0, uint64_t a1, uint64_t b0, uint64_t b1, int i, int axis, const int *c){
+        static const float ee[] ={-0.44f,-0.335f,-0.25f,-0.11f,0,0.11f,0.25f,0.33f,0.44f};
+        int f0 = (a0>>i)&1, f1 = (a0>>(i+1))&1, f2 = (a1>>i)&1, f3 = (a1>>(i+1))&1;
+        int f4 = (b0>>i)&1, f5 = (b0>>(i+1))&1, f6 = (b1>>i)&1, f7 = (b1>>(i+1))&1;
+        int n[3][2];
+        n[axis][0] = f0+f1+f2+f3;
+        n[axis][1] = f4+f5+f6+f7;
+        n[(axis+1)%3][0] = f0+f2+f4+f6;
+        n[(axis+1)%3][1] = f1+f3+f5+f7;
+        n[(axis+2)%3][0] = f0+f1+f4+f5;
+        n[(axis+2)%3][1] = f2+f3+f6+f7;
+        for (int k=0;k<3;k++) {
+            p[k] = c[k]*element_size+element_size*0.5f;
+            int a = n[k][0], b = n[k][1];
+            if (a>b) {
+                p[k]+=ee[a+b]*element_size;
+            } else if(a<b) {
+                p[k]-=ee[a+b]*element_size;
+            }
+            if (nv) nv[k] = (float)(a-b);
+        }
+    }
+
+    // q: corners (u-1,v-1),(u,v-1),(u-1,v),(u,v). dir: +1/-1 along the axis.
+    void emit_quad(MeshChunk &m, float q[4][3], int dir){
+        int vn[] = {0,1,2,3,2,1};
+        float *sq[4] = {q[0], q[1], q[2], q[3]};
+        if (dir < 0) {
+            sq[1] = q[2];
+            sq[2] = q[1];
+        }
+        float n[3];
+        norm(n,sq[2],sq[1],sq[0]);
+        size_t o = m.vart.size();
+        m.vart.resize(o+18);
+        m.norm.resize(o+18);
+        float *pv = &m.vart[o], *pn = &m.norm[o];
+        for (int k=0;k<6;k++) {
+            pv[k*3+0] = sq[vn[k]][0];
+            pv[k*3+1] = sq[vn[k]][1];
+            pv[k*3+2] = sq[vn[k]][2];
+            pn[k*3+0] = n[0];
+            pn[k*3+1] = n[1];
+            pn[k*3+2] = n[2];
+        }
+    }
+
+    // qi: vertices of the corners as in emit_quad.
+    void emit_index(MeshChunk &m, const int *qi, int dir){
+        int vn[] = {0,1,2,3,2,1};
+        int sq[4] = {qi[0], qi[1], qi[2], qi[3]};
+        if (dir < 0) {
+            sq[1] = qi[2];
+            sq[2] = qi[1];
+        }
+        for (int k=0;k<6;k++) {
+            m.index.push_back((uint16_t)sq[vn[k]]);
+        }
+    }
+
+    static bool parallel(const float *p0, const float *p1, const float *e){
+        float d[3] = {p1[0]-p0[0], p1[1]-p0[1], p1[2]-p0[2]};
+        float l = d[0]*d[0]+d[1]*d[1]+d[2]*d[2];
+        float le = e[0]*e[0]+e[1]*e[1]+e[2]*e[2];
+        float t = d[0]*e[0]+d[1]*e[1]+d[2]*e[2];
+        return t > 0 && t*t > 0.999f*0.999f*l*le;
+    }
+
+    // Solid (>0) cells of the box (bo, bn^3) as bit rows:
+    // rows[(axis*bn+layer)*bn+v] bit u, u/v are the two axes after axis.
+    void solid_rows(Node n, int x, int y, int z, int d, const int *bo, int bn, uint64_t *rows){
+        int size = 1<<d;
+        int o[3] = {x, y, z};
+        int c1[3], c2[3];
+        for (int i=0;i<3;i++) {
+            c1[i] = (std::max)(o[i]-bo[i], 0);
+            c2[i] = (std::min)(o[i]+size-bo[i], bn);
+            if (c1[i] >= c2[i]) return;
+        }
+        if (storage.hasChild(n)) {
+            int half = size>>1;
+            for (int i=0;i<8;i++) {
+                solid_rows(child(n, i), x+half*(i&1), y+half*((i>>1)&1), z+half*((i>>2)&1), d-1, bo, bn, rows);
+            }
+            return;
+        }
+        if (storage.value(n) <= 0) return;
+        for (int axis=0;axis<3;axis++) {
+            int ua = (axis+1)%3, va = (axis+2)%3;
+            uint64_t bits = (~(uint64_t)0 >> (64-(c2[ua]-c1[ua]))) << c1[ua];
+            for (int l=c1[axis];l<c2[axis];l++) {
+                uint64_t *r = rows+(axis*bn+l)*bn;
+                for (int v=c1[va];v<c2[va];v++) {
+                    r[v] |= bits;
+                }
+            }
+        }
+    }
+
+    void emit_run(MeshChunk &m, float q[4][3], const int *qi, int dir){
+        OCTREE_PHASE(m.clock, m.stats.emission);
+        if (mesh_format == MESH_TRIANGLES) {
+            emit_quad(m, q, dir);
+        } else {
+            emit_index(m, qi, dir);
+        }
+    }
+
+    // Shared vertex: the normal is the gradient of the cells around the
+    // corner, so it does not depend on the chunk. Flat corners (no
+    // gradient) take the normal of the face.
+    static MeshVertex corner_vertex(const float *p, const float *g, int axis, int dir){
+        MeshVertex v;
+        float l = (float)sqrt(g[0]*g[0]+g[1]*g[1]+g[2]*g[2]);
+        for (int k=0;k<3;k++) {
+            v.pos[k] = p[k];
+            v.norm[k] = l > 0 ? g[k]/l : (k == axis ? (float)dir : 0.0f);
+        }
+        return v;
+    }
+
+    // Meshes the chunk (x,y,z,sz) from its solid rows (with a 1 cell border).
+    // Plane k along each axis lies between layers k-1 and k; a face belongs
+    // to the chunk holding its solid cell. Runs along u with (nearly)
+    // parallel edges are merged.
+    void mesh_chunk(MeshChunk &m, const uint64_t *rows, int x, int y, int z, int sz, bool merge){
+        int bn = sz+2;
+        int org[3] = {x, y, z};
+        uint64_t inner = (~(uint64_t)0 >> (64-sz)) << 1;
+        int cw = sz+1;
+        // corners of the current plane, computed once. stamp: plane id.
+        std::vector<float> cv(cw*cw*3), cn(cw*cw*3);
+        std::vector<int> stamp(cw*cw, -1);
+        // indexed: vertex of each corner of the chunk (-1: none yet).
+        // (sz+1)^3 <= 4913 corners, so 16 bit indices are enough.
+        bool indexed = mesh_format != MESH_TRIANGLES;
+        std::vector<int> vid;
+        if (indexed) vid.assign(cw*cw*cw, -1);
+        int plane = 0;
+        float q[4][3];
+        int qi[4] = {0, 0, 0, 0}, ci[4] = {0, 0, 0, 0};
+        float e1[3], e2[3];
+        int c[3];
+        for (int axis=0;axis<3;axis++) {
+            int ua = (axis+1)%3, va = (axis+2)%3;
+            for (int k=0;k<=sz;k++,plane++) {
+                const uint64_t *A = rows+(axis*bn+k)*bn;
+                const uint64_t *B = A+bn;
+                c[axis] = org[axis]+k-1;
+                for (int v=0;v<sz;v++) {
+                    uint64_t pm = k>0 ? A[v+1] & ~B[v+1] & inner : 0;
+                    uint64_t mm = k<sz ? B[v+1] & ~A[v+1] & inner : 0;
+                    uint64_t fm = pm|mm;
+                    int run = 0, last = -2;
+                    while (fm) {
+                        int bit = ctz64(fm);
+                        fm &= fm-1;
+                        int u = bit-1;
+                        int dir = (pm>>bit)&1 ? 1 : -1;
+                        if (run && u != last+1) {
+                            emit_run(m, q, qi, run);
+                            run = 0;
+                        }
+                        last = u;
+
+                        // corner (i,j): between cells i-1,i along u and j-1,j along v.
+                        float *cc[4];
+                        for (int n=0;n<4;n++) {
+                            int i = u+(n&1), j = v+(n>>1);
+                            cc[n] = &cv[(i+j*cw)*3];
+                            if (stamp[i+j*cw] != plane) {
+                                OCTREE_PHASE(m.clock, m.stats.adjust);
+                                stamp[i+j*cw] = plane;
+                                c[ua] = org[ua]+i-1;
+                                c[va] = org[va]+j-1;
+                                corner_vart(cc[n], &cn[(i+j*cw)*3], A[j], A[j+1], B[j], B[j+1], i, axis, c);
+                            }
+                            if (indexed) {
+                                int l[3];
+                                l[axis] = k; l[ua] = i; l[va] = j;
+                                int &id = vid[l[0]+(l[1]+l[2]*cw)*cw];
+                                if (id < 0) {
+                                    OCTREE_PHASE(m.clock, m.stats.emission);
+                                    id = (int)m.verts.size();
+                                    m.verts.push_back(corner_vertex(cc[n], &cn[(i+j*cw)*3], axis, dir));
+                                }
+                                ci[n] = id;
+                            }
+                        }
+
+                        if (merge && run == dir && parallel(cc[0], cc[1], e1) && parallel(cc[2], cc[3], e2)) {
+                            for (int i=0;i<3;i++) {
+                                q[1][i] = cc[1][i];
+                                q[3][i] = cc[3][i];
+                            }
+                            qi[1] = ci[1];
+                            qi[3] = ci[3];
+                            continue;
+                        }
+
+                        if (run) emit_run(m, q, qi, run);
+                        for (int i=0;i<4;i++) {
+                            qi[i] = ci[i];
+                        }
+                        for (int i=0;i<3;i++) {
+                            q[0][i] = cc[0][i];
+                            q[1][i] = cc[1][i];
+                            q[2][i] = cc[2][i];
+                            q[3][i] = cc[3][i];
+                            e1[i] = cc[1][i]-cc[0][i];
+                            e2[i] = cc[3][i]-cc[2][i];
+                        }
+                        run = dir;
+                    }
+                    if (run) emit_run(m, q, qi, run);
+                }
+            }
+        }
+    }
+
+    // node of the cube (x,y,z,1<<d), or the leaf it lies in.
+    Node chunk_node(int x, int y, int z, int d){
+        Node n = storage.root();
+        for (int l=depth;l>d && storage.hasChild(n);l--) {
+            n = child(n, ((x>>(l-1))&1) | (((y>>(l-1))&1)<<1) | (((z>>(l-1))&1)<<2));
+        }
+        return n;
+    }
+
+    // true if the chunk (x,y,z,1<<d) is one solid leaf (or lies in one).
+    bool solid_chunk(int x, int y, int z, int d){
+        if (x<0 || x>=esize || y<0 || y>=esize || z<0 || z>=esize) return false;
+        Node n = chunk_node(x, y, z, d);
+        return !storage.hasChild(n) && storage.value(n) > 0;
+    }
+
+    // Rebuilds the mesh of chunk ci. Reads the tree and writes only
+    // chunks[ci], so chunks can be built in parallel.
+    void build_chunk(int ci, bool merge, std::vector<uint64_t> &rows){
+        int cd = chunk_level, cs = 1<<cd;
+        int x = (ci%chunk_num)<<cd, y = (ci/chunk_num%chunk_num)<<cd, z = (ci/chunk_num/chunk_num)<<cd;
+        MeshChunk &m = chunks[ci];
+        OCTREE_STAT(m.stats = OctreeMeshStats());
+        OCTREE_PHASE(m.clock, m.stats.traversal);
+        m.vart.clear();
+        m.norm.clear();
+        m.verts.clear();
+        m.qverts.clear();
+        m.index.clear();
+
+        Node n = chunk_node(x, y, z, cd);
+        if (!storage.hasChild(n)) {
+            if (storage.value(n) <= 0) return;
+            OCTREE_PHASE(m.clock, m.stats.neighbors);
+            if (solid_chunk(x-cs,y,z,cd) && solid_chunk(x+cs,y,z,cd) &&
+                    solid_chunk(x,y-cs,z,cd) && solid_chunk(x,y+cs,z,cd) &&
+                    solid_chunk(x,y,z-cs,cd) && solid_chunk(x,y,z+cs,cd)) {
+                return;
+            }
+        }
+        rows.resize(3*(cs+2)*(cs+2));
+        int bo[3] = {x-1, y-1, z-1};
+        std::fill(rows.begin(), rows.end(), 0);
+        solid_rows(storage.root(), 0, 0, 0, depth, bo, cs+2, &rows[0]);
+        mesh_chunk(m, &rows[0], x, y, z, cs, merge);
+        if (merge && !m.verts.empty()) {
+            OCTREE_PHASE(m.clock, m.stats.emission);
+            // drop corners inside merged runs, keep first use order
+            std::vector<int> remap(m.verts.size(), -1);
+            std::vector<MeshVertex> used;
+            for (size_t i=0;i<m.index.size();i++) {
+                int &r = remap[m.index[i]];
+                if (r < 0) {
+                    r = (int)used.size();
+                    used.push_back(m.verts[m.index[i]]);
+                }
+                m.index[i] = (uint16_t)r;
+            }
+            m.verts.swap(used);
+        }
+        if (mesh_format == MESH_QUANTIZED) {
+            OCTREE_PHASE(m.clock, m.stats.emission);
+            int org[3] = {x, y, z};
+            m.qverts.resize(m.verts.size());
+            for (size_t i=0;i<m.verts.size();i++) {
+                for (int k=0;k<3;k++) {
+                    m.qverts[i].pos[k] = (int16_t)floor((m.verts[i].pos[k]/element_size-org[k])*MESH_QUANT+0.5f);
+                    m.qverts[i].norm[k] = (int8_t)floor(m.verts[i].norm[k]*127+0.5f);
+                }
+                m.qverts[i].norm[3] = 0;
+            }
+            std::vector<MeshVertex>().swap(m.verts);
+        }
+    }
+
+    // vertices drawn for the chunk
+    static long chunk_verts(const MeshChunk &m){
+        return (long)(m.vart.size()/3 + m.index.size());
+    }
+
+    // vertex i of chunk ci as MeshVertex (any format but MESH_TRIANGLES)
+    MeshVertex chunk_vertex(int ci, size_t i) const {
+        const MeshChunk &m = chunks[ci];
+        if (mesh_format == MESH_INDEXED) return m.verts[i];
+        int org[3] = {(ci%chunk_num)<<chunk_level, (ci/chunk_num%chunk_num)<<chunk_level, (ci/chunk_num/chunk_num)<<chunk_level};
+        MeshVertex v;
+        for (int k=0;k<3;k++) {
+            v.pos[k] = (org[k]+(float)m.qverts[i].pos[k]/MESH_QUANT)*element_size;
+            v.norm[k] = m.qverts[i].norm[k]/127.0f;
+        }
+        return v;
+    }
+
+    // Collects the chunks of non-empty subtrees.
+    void find_chunks(Node n, int x, int y, int z, int d, std::vector<int> &list){
+        if (d > chunk_level && storage.hasChild(n)) {
+            int half = 1<<(d-1);
+            for (int i=0;i<8;i++) {
+                find_chunks(child(n, i), x+half*(i&1), y+half*((i>>1)&1), z+half*((i>>2)&1), d-1, list);
+            }
+            return;
+        }
+        if (!storage.hasChild(n) && storage.value(n) <= 0) return;
+
+        int size = 1<<d, cs = 1<<chunk_level;
+        for (int zz=z;zz<z+size;zz+=cs) {
+            for (int yy=y;yy<y+size;yy+=cs) {
+                for (int xx=x;xx<x+size;xx+=cs) {
+                    list.push_back((xx>>chunk_level)+((yy>>chunk_level)+(zz>>chunk_level)*chunk_num)*chunk_num);
+                }
+            }
+        }
+    }
+
+    void build_chunks(const std::vector<int> &list, bool merge){
+        for (size_t i=0;i<list.size();i++) {
+            chunk_vart_num -= chunk_verts(chunks[list[i]]);
+        }
+        if (pool && pool->size() > 1 && list.size() > 1) {
+            std::vector<std::vector<uint64_t> > rows(pool->size());
+            pool->run((int)list.size(), [&](int i, int w) {
+                build_chunk(list[i], merge, rows[w]);
+            });
+        } else {
+            std::vector<uint64_t> rows;
+            for (size_t i=0;i<list.size();i++) {
+                build_chunk(list[i], merge, rows);
+            }
+        }
+        for (size_t i=0;i<list.size();i++) {
+            chunk_vart_num += chunk_verts(chunks[list[i]]);
+            OCTREE_STAT(mesh_stats.add(chunks[list[i]].stats));
+        }
+        mesh_stats.chunks += (long)list.size();
+        mesh_stats.verts = chunk_vart_num;
+    }
+
+    // Same surface as make_vartex() (cells with value > 0 are solid), built
+    // per chunk by sweeping two adjacent slices along each axis, like
+    // Voxel.makeSubMesh in js/octree.js. Empty chunks and solid chunks
+    // surrounded by solid chunks are skipped.
+    // Only the chunks marked by edits since the last call are rebuilt
+    // (everything after rotate/mirror/unserialize or a change of `merge`).
+    // With a worker pool the chunks are built in parallel; every chunk has
+    // its own buffer, so the result does not depend on the pool size.
+    // Returns the number of vertices.
+    long make_vartex2(bool merge = true){
         vart_num = 0;
         vart_array.clear();
         norm_array.clear();
-		int sz = esize;
-		ValueType *a = new ValueType[sz*sz*2];
-		
-		for(int i=0;i<sz*sz*2;i++) a[i]=0;
+        mesh_stats = OctreeMeshStats();
+        if (all_dirty || merge != chunk_merge) {
+            chunk_num = esize >> chunk_level;
+            chunks.assign(chunk_num*chunk_num*chunk_num, MeshChunk());
+            dirty.assign(chunks.size(), 0);
+            dirty_chunks.clear();
+            chunk_vart_num = 0;
+            chunk_merge = merge;
+            all_dirty = false;
+            std::vector<int> list;
+            {
+                OCTREE_PHASE(mesh_clock, mesh_stats.traversal);
+                find_chunks(storage.root(), 0, 0, 0, depth, list);
+            }
+            build_chunks(list, merge);
+            return chunk_vart_num;
+        }
+        for (size_t i=0;i<dirty_chunks.size();i++) {
+            dirty[dirty_chunks[i]] = 0;
+        }
+        build_chunks(dirty_chunks, merge);
+        dirty_chunks.clear();
+        return chunk_vart_num;
+    }
+
+    // Drops the cached chunk meshes (like Voxel.clearMesh).
+    void clearMesh(){
+        chunks.clear();
+        chunk_vart_num = 0;
+        all_dirty = true;
+    }
 
-		for (int n=0;n<sz;n++) {
-			ValueType *slice0 = a+(n&1)*sz*sz;
-			ValueType *slice1 = a+((n+1)&1)*sz*sz;
-			get_slicex(slice1,n);
-			for (int i=0;i<sz;i++) {
-				for (int j=0;j<sz;j++) {
-					
-				}
-			}
-		}
+    // pool: used by make_vartex2 (NULL: single thread). Not owned.
+    void setWorkerPool(OctreeWorkerPool *p){
+        pool = p;
+    }
 
+    // MESH_TRIANGLES, MESH_INDEXED or MESH_QUANTIZED. The next
+    // make_vartex2 rebuilds every chunk.
+    void setMeshFormat(int f){
+        if (f == mesh_format) return;
+        mesh_format = f;
+        all_dirty = true;
+    }
 
-		delete [] a;
+    int getMeshFormat() const {
+        return mesh_format;
+    }
 
-        return vart_num;
+    // Vertices and chunks of the last make_vartex/make_vartex2 and the
+    // vertices of every chunk. With _OCTREE_STATS also the time of the
+    // mesher phases (summed over the workers) and the neighbor lookups
+    // (see octree_stats.h); the clocks cost two reads per timed step.
+    OctreeMeshStats meshStats() const {
+        OctreeMeshStats s = mesh_stats;
+        s.chunk_verts.resize(chunks.size());
+        for (size_t i=0;i<chunks.size();i++) {
+            s.chunk_verts[i] = chunk_verts(chunks[i]);
+        }
+        return s;
     }
 
+    // Bytes of vertex and index data held by the chunk meshes.
+    size_t meshBytes() const {
+        size_t n = 0;
+        for (size_t i=0;i<chunks.size();i++) {
+            const MeshChunk &m = chunks[i];
+            n += (m.vart.size() + m.norm.size()) * sizeof(float);
+            n += m.verts.size() * sizeof(MeshVertex) + m.qverts.size() * sizeof(MeshVertexQ);
+            n += m.index.size() * sizeof(uint16_t);
+        }
+        return n;
+    }
 
+    // Exports the current mesh (make_vartex or make_vartex2, any format)
+    // as triangle arrays, 3 floats per vertex, in chunk order.
+    void getMesh(std::vector<float> &vart, std::vector<float> &norm) const {
+        vart.assign(vart_array.begin(), vart_array.end());
+        norm.assign(norm_array.begin(), norm_array.end());
+        for (size_t ci=0;ci<chunks.size();ci++) {
+            const MeshChunk &m = chunks[ci];
+            vart.insert(vart.end(), m.vart.begin(), m.vart.end());
+            norm.insert(norm.end(), m.norm.begin(), m.norm.end());
+            for (size_t i=0;i<m.index.size();i++) {
+                MeshVertex v = chunk_vertex((int)ci, m.index[i]);
+                vart.insert(vart.end(), v.pos, v.pos+3);
+                norm.insert(norm.end(), v.norm, v.norm+3);
+            }
+        }
+    }
 
+    // Exports the current mesh as an indexed triangle list. Vertices of
+    // MESH_TRIANGLES meshes are not shared.
+    void getMesh(std::vector<MeshVertex> &verts, std::vector<uint32_t> &index) const {
+        verts.clear();
+        index.clear();
+        for (size_t i=0;i<vart_array.size();i+=3) {
+            MeshVertex v;
+            for (int k=0;k<3;k++) {
+                v.pos[k] = vart_array[i+k];
+                v.norm[k] = norm_array[i+k];
+            }
+            index.push_back((uint32_t)verts.size());
+            verts.push_back(v);
+        }
+        for (size_t ci=0;ci<chunks.size();ci++) {
+            const MeshChunk &m = chunks[ci];
+            for (size_t i=0;i<m.vart.size();i+=3) {
+                MeshVertex v;
+                for (int k=0;k<3;k++) {
+                    v.pos[k] = m.vart[i+k];
+                    v.norm[k] = m.norm[i+k];
+                }
+                index.push_back((uint32_t)verts.size());
+                verts.push_back(v);
+            }
+            uint32_t base = (uint32_t)verts.size();
+            size_t n = m.verts.size() + m.qverts.size();
+            for (size_t i=0;i<n;i++) {
+                verts.push_back(chunk_vertex((int)ci, i));
+            }
+            for (size_t i=0;i<m.index.size();i++) {
+                index.push_back(base + m.index[i]);
+            }
+        }
+    }
 
+
+#ifndef OCTREE_NO_GL
     void draw(){
         
         //_obt@ݒ
         glEnableClientState(GL_VERTEX_ARRAY);
-        glVertexPointer(3, GL_FLOAT, 0, &(vart_array[0]));
 
         //@z̎w
         glEnableClientState(GL_NORMAL_ARRAY);
-        glNormalPointer(GL_FLOAT,0,&(norm_array[0]));
+        if (mesh_format == MESH_QUANTIZED) {
+            // normals are scaled with the quantized positions
+            glPushAttrib(GL_ENABLE_BIT);
+            glEnable(GL_NORMALIZE);
+        }
         
         //`
         glPushMatrix();
             glTranslatef(-element_size*esize/2, -element_size*esize/2, -element_size*esize/2);
-            glDrawArrays(GL_TRIANGLES, 0, vart_num);
+            if (vart_num > 0) {
+                glVertexPointer(3, GL_FLOAT, 0, &(vart_array[0]));
+                glNormalPointer(GL_FLOAT,0,&(norm_array[0]));
+                glDrawArrays(GL_TRIANGLES, 0, vart_num);
+            }
+            for (size_t i=0;i<chunks.size();i++) {
+                const MeshChunk &m = chunks[i];
+                if (!m.vart.empty()) {
+                    glVertexPointer(3, GL_FLOAT, 0, &(m.vart[0]));
+                    glNormalPointer(GL_FLOAT,0,&(m.norm[0]));
+                    glDrawArrays(GL_TRIANGLES, 0, (GLsizei)(m.vart.size()/3));
+                } else if (!m.verts.empty()) {
+                    glVertexPointer(3, GL_FLOAT, sizeof(MeshVertex), m.verts[0].pos);
+                    glNormalPointer(GL_FLOAT, sizeof(MeshVertex), m.verts[0].norm);
+                    glDrawElements(GL_TRIANGLES, (GLsizei)m.index.size(), GL_UNSIGNED_SHORT, &(m.index[0]));
+                } else if (!m.qverts.empty()) {
+                    int ci = (int)i;
+                    glPushMatrix();
+                    glTranslatef(((ci%chunk_num)<<chunk_level)*element_size, ((ci/chunk_num%chunk_num)<<chunk_level)*element_size, ((ci/chunk_num/chunk_num)<<chunk_level)*element_size);
+                    glScalef(element_size/MESH_QUANT, element_size/MESH_QUANT, element_size/MESH_QUANT);
+                    glVertexPointer(3, GL_SHORT, sizeof(MeshVertexQ), m.qverts[0].pos);
+                    glNormalPointer(GL_BYTE, sizeof(MeshVertexQ), m.qverts[0].norm);
+                    glDrawElements(GL_TRIANGLES, (GLsizei)m.index.size(), GL_UNSIGNED_SHORT, &(m.index[0]));
+                    glPopMatrix();
+                }
+            }
         glPopMatrix();
 
         glDisableClientState(GL_VERTEX_ARRAY);
         glDisableClientState(GL_NORMAL_ARRAY);
+        if (mesh_format == MESH_QUANTIZED) {
+            glPopAttrib();
+        }
 
     }
+#endif
 
 
 };
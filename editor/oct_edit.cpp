@@ -52,9 +52,12 @@ bool change_depth(int zz)
 	z=zz;
     bmp1.clear(Color::white);
     DCPen *p = bmp1.dcpen();
-    for (int x=0;x<octree.size();x++) {
-        for (int y=0;y<octree.size();y++) {
-            int v = octree.getValue(x,y,z);
+    int sz=octree.size();
+    vector<ValueType> slice(sz*sz);
+    octree.get_slicez(&slice[0],z);
+    for (int x=0;x<sz;x++) {
+        for (int y=0;y<sz;y++) {
+            int v = slice[x+y*sz];
             if (v>0) {
                 p->color(Color::silver);
             } else {
@@ -126,7 +129,8 @@ bool onMenuExit(Event &e)
 bool on_save(Event &e)
 {
     vector<char> buf;
-    octree.serialize(buf);
+    OctreeVectorSink out(buf);
+    octree.save(out);
     File::save("data/test.octree",buf);
     return true;
 }
@@ -135,8 +139,14 @@ bool on_load(Event &e)
 {
     vector<char> buf;
     File::load("data/test.octree",buf);
-    octree.unserialize(buf);
-    octree.make_vartex();
+    OctreeMemorySource in(buf);
+    octree.beginEdit();
+    if (!octree.load(in)) {
+        octree.unserialize(buf); // old format
+    }
+    octree.endEdit();
+    octree.compact();
+    octree.make_vartex2();
     change_depth(z);
     return true;
 }
@@ -144,26 +154,46 @@ bool on_load(Event &e)
 bool on_copy(Event &e)
 {
     int sz=octree.size();
-    tmpbuf.resize(sz*sz);
-    for (int i=0;i<sz*sz;i++)
-        tmpbuf[i] = octree.getValue(i%sz,i/sz,z);
+    vector<ValueType> slice(sz*sz);
+    octree.get_slicez(&slice[0],z);
+    tmpbuf.assign(slice.begin(),slice.end());
     return true;
 }
 
 bool on_paste(Event &e)
 {
     int sz=octree.size();
+    octree.beginEdit();
     for (int i=0;i<tmpbuf.size();i++)
         octree.setValue(i%sz,i/sz,z,tmpbuf[i]);
-    octree.make_vartex();
+    octree.endEdit();
+    octree.make_vartex2();
     change_depth(z);
     return true;
 }
 
+bool on_undo(Event &e)
+{
+    if (octree.undo()) {
+        octree.make_vartex2();
+        change_depth(z);
+    }
+    return true;
+}
+
+bool on_redo(Event &e)
+{
+    if (octree.redo()) {
+        octree.make_vartex2();
+        change_depth(z);
+    }
+    return true;
+}
+
 bool on_rotate_z(Event &e)
 {
     octree.rotate_z();
-    octree.make_vartex();
+    octree.make_vartex2();
     change_depth(z);
     return true;
 }
@@ -249,6 +279,9 @@ int main(){
 			.add("Exit",menuhandler.add(onMenuExit))
 		)
 		.add("&Edit",Menu(&menuhandler)
+			.add("&Undo",on_undo)
+			.add("&Redo",on_redo)
+			.add(MenuItem("-"))
 			.add("&Copy",on_copy)
 			.add("Cu&t",on_copy)
 			.add("&Paste",on_paste)
@@ -298,7 +331,7 @@ int main(){
     glMatrixMode(GL_MODELVIEW);
 
     octree.scrapeSphere(0,0,0,20);
-    octree.make_vartex();
+    octree.make_vartex2();
 
     bool drawing = false;
     Point pos1;
@@ -322,6 +355,7 @@ int main(){
                 if (!drawing) {
                     pos1 = Point(x,y);
                     drawing = true;
+                    octree.beginEdit();
                 }
                 if (draw_mode==0 && octree.getValue(x,y,z) != fg_color) {
                     int v=fg_color;
@@ -337,7 +371,7 @@ int main(){
                     p->boxf(x*8,y*8,7,7);
                     p->release();
                     pic1.update();
-                    octree.make_vartex();
+                    octree.make_vartex2();
                 }
             }
         } else {
@@ -346,17 +380,13 @@ int main(){
                 int x1 = m.x/8;
                 int y1 = m.y/8;
                 if (draw_mode==2) {
-                    int x,y;
-                    for (y = pos1.y;y<=y1;y++) {
-                        for (x = pos1.x;x<=x1;x++) {
-                            octree.setValue(x,y,z,fg_color);
-                        }
-                    }
+                    octree.box(pos1.x,pos1.y,z,x1-pos1.x+1,y1-pos1.y+1,1,fg_color);
                     pic1.update();
-                    octree.make_vartex();
+                    octree.make_vartex2();
 				    change_depth(z);
                 }
                 drawing=false;
+                octree.endEdit();
             }
         }
         
@@ -3,17 +3,348 @@
 
 #include <vector>
 #include "octree_node.h"
+#include "octree_linear.h"
+#include "octree_fill.h"
+#include "octree_region.h"
+#include "octree_voxf.h"
+#include "octree_stream.h"
+#include "octree_orient.h"
+#include "octree_ray.h"
+#include "octree_cursor.h"
+#include "octree_iter.h"
+#include "octree_csg.h"
+#include "octree_dense.h"
+#include "octree_stats.h"
+#include "octree_batch.h"
 
-template<typename V>
+// S: storage backend (OctreeNodeStorage, OctreeLinearStorage)
+//
+// The tree has an orientation (see octree_orient.h): rotations and
+// mirrors only change it, and children are looked up through it. bake()
+// rewrites the storage in the layout of the tree.
+template<typename V, typename S = OctreeNodeStorage<V> >
 class Octree{
+    template<typename, typename> friend class Octree;
+
 protected:
-    OctreeNode<V> element;
+    typedef typename S::Node Node;
+
+    S storage;
     const int depth;
     int esize;
-    
+    OctreeOrientation orient;
+
+    // child i of n in the orientation of the tree
+    inline Node child(Node n, int i) const {
+        return storage.child(n, orient.child[i]);
+    }
+    inline Node mutableChild(Node n, int i) {
+        return storage.mutableChild(n, orient.child[i]);
+    }
+
+    void serialize(Node n, std::vector<char> &buf) const {
+        if (!storage.hasChild(n)) {
+            buf.push_back(0);
+            buf.push_back(storage.value(n));
+        } else {
+            buf.push_back(1);
+            for (int i=0;i<8;i++) {
+                serialize(child(n, i), buf);
+            }
+        }
+    }
+
+    void unserialize(Node n, const std::vector<char> &buf, int &p) {
+        if (buf[p]==0) {
+            p++;
+            storage.collapse(n, buf[p++]);
+        } else {
+            p++;
+            storage.collapse(n, storage.value(n));
+            storage.split(n);
+            for (int i=0;i<8;i++) {
+                unserialize(storage.mutableChild(n, i), buf, p);
+            }
+        }
+    }
+
+    // Reorders the children of every node, so that stored child i is
+    // child i of the tree. Each cycle of orient.child is done by swaps.
+    void bake(Node n) {
+        if (!storage.hasChild(n)) return;
+        bool done[8] = {false};
+        for (int s=0;s<8;s++) {
+            if (done[s]) continue;
+            done[s] = true;
+            for (int j=s;orient.child[j]!=s;j=orient.child[j]) {
+                storage.swap(storage.mutableChild(n, j), storage.mutableChild(n, orient.child[j]));
+                done[orient.child[j]] = true;
+            }
+        }
+        for (int i=0;i<8;i++) {
+            bake(storage.mutableChild(n, i));
+        }
+    }
+
+    // Copies the cells of n (the cube (x,y,z,1<<d)) that are in box b to
+    // out, which holds cell (b.x1,b.y1,b.z1), with the strides st. Leaves
+    // are filled as blocks. Used by toDense and the slices.
+    void dense(Node n, long x, long y, long z, int d, const OctreeBox &b, V *out, const long st[3]) const {
+        if (!storage.hasChild(n)) {
+            if (d == 0) {
+                out[(x-b.x1)*st[0] + (y-b.y1)*st[1] + (z-b.z1)*st[2]] = storage.value(n);
+                return;
+            }
+            long s = 1L << d;
+            long x1 = std::max<long>(x, b.x1), y1 = std::max<long>(y, b.y1), z1 = std::max<long>(z, b.z1);
+            long x2 = std::min<long>(x+s, b.x2), y2 = std::min<long>(y+s, b.y2), z2 = std::min<long>(z+s, b.z2);
+            octree_fill(out + (x1-b.x1)*st[0] + (y1-b.y1)*st[1] + (z1-b.z1)*st[2],
+                x2-x1, y2-y1, z2-z1, st[0], st[1], st[2], storage.value(n));
+            return;
+        }
+        // children in the box: masks of the low/high half along each axis
+        static const unsigned char half_mask[3][4] = {
+            {0, 0x55, 0xaa, 0xff}, {0, 0x33, 0xcc, 0xff}, {0, 0x0f, 0xf0, 0xff}};
+        long half = 1L << (d-1);
+        unsigned m = half_mask[0][(b.x1 < x+half) | (b.x2 > x+half) << 1] &
+            half_mask[1][(b.y1 < y+half) | (b.y2 > y+half) << 1] &
+            half_mask[2][(b.z1 < z+half) | (b.z2 > z+half) << 1];
+        for (int i=0;m;i++, m>>=1) {
+            if (m & 1) dense(child(n, i), x+half*(i&1), y+half*((i>>1)&1), z+half*((i>>2)&1), d-1, b, out, st);
+        }
+    }
+
+    // axis: 0:x 1:y 2:z. buf[u+v*stride], u/v are the next two axes.
+    // Square (1<<n)^2 at c, or the whole plane.
+    void slice(const int c[3], int n, int axis, V *buf, int stride) const {
+        int ua = (axis+1)%3, va = (axis+2)%3;
+        long st[3];
+        st[axis] = 0;
+        st[ua] = 1;
+        st[va] = stride;
+        int lo[3] = {c[0], c[1], c[2]}, ext[3] = {1<<n, 1<<n, 1<<n};
+        ext[axis] = 1;
+        dense(storage.root(), 0, 0, 0, depth, OctreeBox(lo[0], lo[1], lo[2], ext[0], ext[1], ext[2]), buf, st);
+    }
+
+    // n is at level l (0: root). Children in stored order.
+    void stats(Node n, int l, OctreeTreeStats<V> &st) const {
+        st.nodes[l]++;
+        if (!storage.hasChild(n)) {
+            const V &v = storage.value(n);
+            st.leaves[l]++;
+            st.values[v]++;
+            st.cells[v] += (uint64_t)1 << 3*(depth-l);
+            return;
+        }
+        for (int i=0;i<8;i++) {
+            stats(storage.child(n, i), l+1, st);
+        }
+    }
+
+    template<typename F>
+    bool applyFunc(Node n, const F &f, long x, long y, long z, int d, const V &v, OctreeBox &changed) {
+        if (!storage.hasChild(n) && storage.value(n) == v) return false;
+        int r = f(x, y, z, 1L<<d);
+        if (r == OCTREE_REGION_ALL) {
+            storage.collapse(n, v);
+            changed.add(x, y, z, 1<<d);
+            return true;
+        }
+        if (r != OCTREE_REGION_PARTIAL || d == 0) return false;
+
+        bool split = !storage.hasChild(n);
+        if (split) storage.split(n);
+        long half = 1L << (d-1);
+        bool cf = false;
+        for (int i=0;i<8;i++) {
+            cf |= applyFunc(mutableChild(n, i), f, x+half*(i&1), y+half*((i>>1)&1), z+half*((i>>2)&1), d-1, v, changed);
+        }
+        if (!cf) {
+            if (split) storage.collapse(n, storage.value(n));
+            return false;
+        }
+        for (int i=0;i<8;i++) {
+            Node c = storage.child(n, i);
+            if (storage.hasChild(c) || storage.value(c) != v) return true;
+        }
+        storage.collapse(n, v);
+        return true;
+    }
+
+    inline bool fill(Node n, const V &v, long x, long y, long z, int d, OctreeBox &changed) {
+        if (!storage.hasChild(n) && storage.value(n) == v) return false;
+        storage.collapse(n, v);
+        changed.add(x, y, z, 1<<d);
+        return true;
+    }
+
+    // Copies subtree b of o (in the orientation of o) to n.
+    template<typename S2>
+    void take(Node n, const Octree<V, S2> &o, typename S2::Node b) {
+        const S2 &s = o.storage;
+        if (!s.hasChild(b)) {
+            storage.collapse(n, s.value(b));
+            return;
+        }
+        storage.collapse(n, s.value(b));
+        storage.split(n);
+        for (int i=0;i<8;i++) {
+            take(mutableChild(n, i), o, o.child(b, i));
+        }
+    }
+
+    // Node a of this tree and node b of o cover the cube (x,y,z,1<<d).
+    template<typename S2, typename Op>
+    bool combine(Node a, const Octree<V, S2> &o, typename S2::Node b, const Op &op, long x, long y, long z, int d, OctreeBox &changed) {
+        const S2 &s = o.storage;
+        bool la = !storage.hasChild(a), lb = !s.hasChild(b);
+        V v;
+        if (lb) {
+            int r = op.other(s.value(b), v);
+            if (r == OCTREE_CSG_KEEP) return false;
+            if (r == OCTREE_CSG_TAKE) return fill(a, s.value(b), x, y, z, d, changed);
+            if (r == OCTREE_CSG_FILL) return fill(a, v, x, y, z, d, changed);
+            if (la) return fill(a, op(storage.value(a), s.value(b)), x, y, z, d, changed);
+        } else if (la) {
+            int r = op.self(storage.value(a), v);
+            if (r == OCTREE_CSG_KEEP) return false;
+            if (r == OCTREE_CSG_FILL) return fill(a, v, x, y, z, d, changed);
+            if (r == OCTREE_CSG_TAKE) {
+                if (!(orient == o.orient && octree_share(storage, a, s, b))) take(a, o, b);
+                changed.add(x, y, z, 1<<d);
+                return true;
+            }
+        }
+
+        bool split = la;
+        if (split) storage.split(a);
+        long half = 1L << (d-1);
+        bool cf = false;
+        for (int i=0;i<8;i++) {
+            cf |= combine(mutableChild(a, i), o, lb ? b : o.child(b, i), op,
+                x+half*(i&1), y+half*((i>>1)&1), z+half*((i>>2)&1), d-1, changed);
+        }
+        if (!cf) {
+            if (split) storage.collapse(a, storage.value(a));
+            return false;
+        }
+        Node c = storage.child(a, 0);
+        if (storage.hasChild(c)) return true;
+        v = storage.value(c);
+        for (int i=1;i<8;i++) {
+            c = storage.child(a, i);
+            if (storage.hasChild(c) || storage.value(c) != v) return true;
+        }
+        storage.collapse(a, v);
+        return true;
+    }
+
+    // n is a leaf for the cube (x,y,z,1<<d) of vol (stored coordinates).
+    void fromDense(Node n, const OctreeDenseVolume<V> &vol, long x, long y, long z, int d, size_t m) {
+        if (vol.uniform(x, y, z, d, m)) {
+            storage.collapse(n, vol.at(x, y, z));
+            return;
+        }
+        storage.split(n);
+        long half = 1L << (d-1);
+        for (int i=0;i<8;i++) {
+            fromDense(storage.mutableChild(n, i), vol, x+half*(i&1), y+half*((i>>1)&1), z+half*((i>>2)&1), d-1, m*8+i);
+        }
+    }
+
+    // Keys of the cells c[0..n) in the tree (T: OctreeEdit, OctreeCoord),
+    // sorted by Morton code of the stored coordinates, to b.keys. False if
+    // the tree is too deep for the codes.
+    template<typename T>
+    bool mortonKeys(const T *c, size_t n, OctreeBatchBuffer &b) const {
+        if (depth > 21) return false;
+        const OctreeMortonTable &mt = octree_morton_table();
+        bool oriented = !orient.identity();
+        std::vector<OctreeMortonKey> &k = b.keys;
+        k.resize(n);
+        size_t m = 0;
+        for (size_t j=0;j<n;j++) {
+            long x = c[j].x, y = c[j].y, z = c[j].z;
+            if (x<0 || x>=esize || y<0 || y>=esize || z<0 || z>=esize) continue;
+            if (oriented) orient.apply(x, y, z, esize);
+            k[m].code = mt.code(x, y, z);
+            k[m].i = (uint32_t)j;
+            m++;
+        }
+        k.resize(m);
+        octree_morton_sort(k, b.tmp);
+        return true;
+    }
+
+    // Merges n into a leaf if its children are leaves of one value.
+    bool merge(Node n) {
+        Node c = storage.child(n, 0);
+        if (storage.hasChild(c)) return false;
+        V v = storage.value(c);
+        for (int i=1;i<8;i++) {
+            c = storage.child(n, i);
+            if (storage.hasChild(c) || storage.value(c) != v) return false;
+        }
+        storage.collapse(n, v);
+        return true;
+    }
+
+    // node record of save(): child mask, same-value mask, leaf values.
+    template<typename W>
+    void saveNode(W &w, Node n, V &last) const {
+        unsigned char mask = 0;
+        for (int i=0;i<8;i++) {
+            if (storage.hasChild(child(n, i))) mask |= 1<<i;
+        }
+        w.byte(mask);
+        if (mask == 0xff) return;
+        unsigned char same = 0;
+        V prev = last;
+        for (int i=0;i<8;i++) {
+            if (mask & (1<<i)) continue;
+            const V &v = storage.value(child(n, i));
+            if (v == prev) same |= 1<<i;
+            prev = v;
+        }
+        w.byte(same);
+        for (int i=0;i<8;i++) {
+            if ((mask|same) & (1<<i)) continue;
+            OctreeValueCodec<V>::write(w, storage.value(child(n, i)));
+        }
+        last = prev;
+    }
+
+    template<typename R>
+    unsigned char loadNode(R &r, Node n, V &last) {
+        storage.split(n);
+        unsigned char mask = r.byte();
+        if (mask == 0xff) return mask;
+        unsigned char same = r.byte();
+        for (int i=0;i<8;i++) {
+            if (mask & (1<<i)) continue;
+            if (!(same & (1<<i))) last = OctreeValueCodec<V>::read(r);
+            storage.collapse(storage.mutableChild(n, i), last);
+        }
+        return mask;
+    }
+
 public:
-    Octree(int d = 5, V v = V()) : depth(d), esize( 1 << d ) {
-        element.value = v;
+    Octree(int d = 5, V v = V()) : storage(v), depth(d), esize( 1 << d ) {
+    }
+
+    // Tree over a copy of s, e.g. a snapshot of another tree's
+    // OctreeSharedStorage.
+    Octree(int d, const S &s) : storage(s), depth(d), esize( 1 << d ) {
+    }
+
+    // The storage is in its own layout: see orientation() and bake().
+    const S& getStorage() const {
+        return storage;
+    }
+
+    S& getStorage() {
+        return storage;
     }
 
     int size(){
@@ -23,81 +354,562 @@ public:
     void setValue(long x, long y, long z, V v){
     	int size = 1 << depth;
         if (x<0 || x>=size || y<0 || y>=size || z<0 || z>=size) return;
+        orient.apply(x, y, z, size);
 
-        element.setValue(x << (MAX_DEPTH - depth) , y << (MAX_DEPTH - depth), z << (MAX_DEPTH - depth), depth, v);
+        storage.setValue(x << (MAX_DEPTH - depth) , y << (MAX_DEPTH - depth), z << (MAX_DEPTH - depth), depth, v);
     }
 
     V getValue(long x, long y, long z) {
     	int size = 1 << depth;
         if (x<0 || x>=size || y<0 || y>=size || z<0 || z>=size) return -1;
+        orient.apply(x, y, z, size);
 
-        return element.getValue(x << (MAX_DEPTH - depth) , y << (MAX_DEPTH - depth), z << (MAX_DEPTH - depth), depth);
+        return storage.getValue(x << (MAX_DEPTH - depth) , y << (MAX_DEPTH - depth), z << (MAX_DEPTH - depth), depth);
+    }
+
+    // setValue for n edits in order. The edits are sorted by Morton code
+    // (the edits of a cell keep their order) and applied in one walk: an
+    // edit goes up only to the common ancestor with the last one and down
+    // from there, so shared paths are visited and split once, and a node
+    // is checked for a merge once, when the walk leaves it. Returns the
+    // box of the changed cells. b keeps the buffers between batches.
+    // Trees deeper than 21 levels take the edits one by one.
+    OctreeBox setValues(const OctreeEdit<V> *edits, size_t n) {
+        OctreeBatchBuffer b;
+        return setValues(edits, n, b);
+    }
+    OctreeBox setValues(const OctreeEdit<V> *edits, size_t n, OctreeBatchBuffer &b) {
+        OctreeBox changed;
+        if (!mortonKeys(edits, n, b)) {
+            for (size_t j=0;j<n;j++) {
+                const OctreeEdit<V> &e = edits[j];
+                if (e.x<0 || e.x>=esize || e.y<0 || e.y>=esize || e.z<0 || e.z>=esize) continue;
+                if (getValue(e.x, e.y, e.z) == e.value) continue;
+                setValue(e.x, e.y, e.z, e.value);
+                changed.add(e.x, e.y, e.z, 1);
+            }
+            return changed;
+        }
+        const std::vector<OctreeMortonKey> &k = b.keys;
+        // path[l]: node at level l (0: root) of the last edit, down to
+        // level top. dirty[l]: a child of path[l] changed since the walk
+        // entered it.
+        Node path[MAX_DEPTH+1];
+        bool dirty[MAX_DEPTH+1];
+        path[0] = storage.root();
+        dirty[0] = false;
+        int top = 0;
+        for (size_t j=0;j<k.size();j++) {
+            uint64_t code = k[j].code;
+            if (j > 0) {
+                int l = (std::min)(top, depth - octree_morton_level(k[j-1].code, code));
+                for (int u=top;u>l;u--) {
+                    if (dirty[u] && merge(path[u])) dirty[u-1] = true;
+                }
+                top = l;
+            }
+            // level where the next edit leaves this path
+            int pl = j+1 < k.size() ? depth - octree_morton_level(code, k[j+1].code) : -1;
+            const OctreeEdit<V> &e = edits[k[j].i];
+            Node c = path[top];
+            int l = top;
+            for (;l<depth;l++) {
+                if (!storage.hasChild(c)) {
+                    if (storage.value(c) == e.value) break;
+                    storage.split(c);
+                } else if (l == pl) {
+                    octree_prefetch(storage, c, (int)(k[j+1].code >> 3*(depth-l-1)) & 7);
+                }
+                c = storage.mutableChild(c, (int)(code >> 3*(depth-l-1)) & 7);
+                path[l+1] = c;
+                dirty[l+1] = false;
+            }
+            top = l;
+            if (l == depth && storage.value(c) != e.value) {
+                storage.collapse(c, e.value);
+                changed.add(e.x, e.y, e.z, 1);
+                // the next edit looks the cell up again (the node may
+                // have moved, see OctreeConcurrentStorage)
+                if (l > 0) {
+                    dirty[l-1] = true;
+                    top = l-1;
+                }
+            }
+        }
+        for (int u=top;u>=0;u--) {
+            if (dirty[u] && merge(path[u]) && u > 0) dirty[u-1] = true;
+        }
+        return changed;
+    }
+
+    // getValue for n cells: out[j] is the value of c[j] (-1 outside the
+    // tree). The cells are sorted by Morton code and looked up in one walk
+    // as in setValues, which asks for the node the next cell goes to
+    // where its path leaves the one of the current cell.
+    void getValues(const OctreeCoord *c, size_t n, V *out) const {
+        OctreeBatchBuffer b;
+        getValues(c, n, out, b);
+    }
+    void getValues(const OctreeCoord *c, size_t n, V *out, OctreeBatchBuffer &b) const {
+        if (!mortonKeys(c, n, b)) {
+            for (size_t j=0;j<n;j++) {
+                long x = c[j].x, y = c[j].y, z = c[j].z;
+                if (x<0 || x>=esize || y<0 || y>=esize || z<0 || z>=esize) {
+                    out[j] = -1;
+                    continue;
+                }
+                orient.apply(x, y, z, esize);
+                out[j] = storage.getValue(x << (MAX_DEPTH - depth), y << (MAX_DEPTH - depth), z << (MAX_DEPTH - depth), depth);
+            }
+            return;
+        }
+        const std::vector<OctreeMortonKey> &k = b.keys;
+        if (k.size() < n) {
+            for (size_t j=0;j<n;j++) {
+                if (c[j].x<0 || c[j].x>=esize || c[j].y<0 || c[j].y>=esize || c[j].z<0 || c[j].z>=esize) out[j] = -1;
+            }
+        }
+        Node path[MAX_DEPTH+1];
+        path[0] = storage.root();
+        int top = 0;
+        for (size_t j=0;j<k.size();j++) {
+            uint64_t code = k[j].code;
+            if (j > 0) top = (std::min)(top, depth - octree_morton_level(k[j-1].code, code));
+            int pl = j+1 < k.size() ? depth - octree_morton_level(code, k[j+1].code) : -1;
+            Node nd = path[top];
+            int l = top;
+            for (;l<depth && storage.hasChild(nd);l++) {
+                if (l == pl) octree_prefetch(storage, nd, (int)(k[j+1].code >> 3*(depth-l-1)) & 7);
+                nd = storage.child(nd, (int)(code >> 3*(depth-l-1)) & 7);
+                path[l+1] = nd;
+            }
+            top = l;
+            out[k[j].i] = storage.value(nd);
+        }
     }
 
 	void rotate_z(){
-		element.rotate_z();
+		rotate(2);
 	}
 
+    // Quarter turns around axis (0:x 1:y 2:z) and mirrors. O(1): only the
+    // orientation changes.
+    void rotate(int axis, int turns = 1) {
+        orient = orient * OctreeOrientation::rotation(axis, turns);
+    }
+
+    void mirror(int axis) {
+        orient = orient * OctreeOrientation::mirror(axis);
+    }
+
+    const OctreeOrientation& orientation() const {
+        return orient;
+    }
+
+    // Rewrites the storage in the layout of the tree (e.g. before using
+    // getStorage() directly). Costs a pass over the tree.
+    void bake() {
+        if (orient.identity()) return;
+        bake(storage.root());
+        orient = OctreeOrientation();
+    }
+
+
+    // Sets v to every cell the classifier f marks as inside (see
+    // octree_region.h). Returns the bounding box of the changed nodes.
+    template<typename F>
+    OctreeBox applyFunc(const F &f, V v) {
+        OctreeBox changed;
+        applyFunc(storage.root(), f, 0, 0, 0, depth, v, changed);
+        return changed;
+    }
+
+    OctreeBox sphere(int x, int y, int z, int r, V v) {
+        return applyFunc(OctreeSphereFunc(x, y, z, r), v);
+    }
+
+    OctreeBox box(int x, int y, int z, int w, int h, int d, V v) {
+        return applyFunc(OctreeBoxFunc(OctreeBox(x, y, z, w, h, d)), v);
+    }
+
+    OctreeBox cube(int cx, int cy, int cz, int size, V v) {
+        return box(cx - size/2, cy - size/2, cz - size/2, size, size, size, v);
+    }
 
     void scrapeSphere(int x,int y,int z,int r) {
-        int xx,yy,zz;
-        for (zz=0;zz<r;zz++) {
-            for (yy=0;yy<r;yy++) {
-                for (xx=0;xx<r;xx++) {
-                    if (xx*xx+yy*yy+zz*zz<r*r) {
-                        setValue(x+xx,y+yy,z+zz,0);
-                        setValue(x-xx,y+yy,z+zz,0);
-                        setValue(x+xx,y-yy,z+zz,0);
-                        setValue(x-xx,y-yy,z+zz,0);
-                        setValue(x+xx,y+yy,z-zz,0);
-                        setValue(x-xx,y+yy,z-zz,0);
-                        setValue(x+xx,y-yy,z-zz,0);
-                        setValue(x-xx,y-yy,z-zz,0);
-                    }
-                }
+        sphere(x, y, z, r, 0);
+    }
+
+    // Boolean operations with a tree o of the same depth (see
+    // octree_csg.h), walking both trees together: a subtree where one side
+    // decides the result is filled or copied in one step (shared with o if
+    // both are OctreeSharedStorage in the same orientation), and uniform
+    // children are merged on the way back, so the cost depends on the
+    // nodes of the trees, not the cells. o must not be this tree. Returns
+    // the bounding box of the changed nodes (empty if the depths differ).
+    template<typename S2, typename Op>
+    OctreeBox combine(const Octree<V, S2> &o, const Op &op) {
+        OctreeBox changed;
+        if (o.depth != depth) return changed;
+        combine(storage.root(), o, o.storage.root(), op, 0, 0, 0, depth, changed);
+        return changed;
+    }
+
+    // Cells get f(a, b) of their values a in this tree and b in o.
+    template<typename S2, typename F>
+    OctreeBox csg(const Octree<V, S2> &o, const F &f) {
+        return combine(o, OctreeCsgFunc<V, F>(f));
+    }
+
+    template<typename S2>
+    OctreeBox unite(const Octree<V, S2> &o) {
+        return combine(o, OctreeCsgUnion<V>());
+    }
+
+    template<typename S2>
+    OctreeBox intersect(const Octree<V, S2> &o) {
+        return combine(o, OctreeCsgIntersect<V>());
+    }
+
+    template<typename S2>
+    OctreeBox subtract(const Octree<V, S2> &o) {
+        return combine(o, OctreeCsgSubtract<V>());
+    }
+
+    // o over this tree, but its cells with the value mask.
+    template<typename S2>
+    OctreeBox paste(const Octree<V, S2> &o, V mask = V()) {
+        return combine(o, OctreeCsgPaste<V>(mask));
+    }
+
+    // Sets the cube (x,y,z,size) from a dense volume: cell (x+i,y+j,z+k)
+    // is data[i*sx+j*sy+k*sz]. size is a power of 2 and the cube is
+    // aligned to it. The uniform cubes of the volume are found bottom up
+    // first (in parallel with a pool), then only the nodes that stay are
+    // made, and the ancestors are merged if the cube made them uniform.
+    // Returns the box of the cube (empty if it is not a valid cube).
+    OctreeBox fromDense(long x, long y, long z, long size, const V *data, long sx, long sy, long sz,
+            OctreeWorkerPool *pool = NULL) {
+        int d = size > 0 ? octree_bit_length(size)-1 : -1;
+        if (d < 0 || size != 1L<<d || d > depth || ((x|y|z) & (size-1)) ||
+                x<0 || x>=esize || y<0 || y>=esize || z<0 || z>=esize) {
+            return OctreeBox();
+        }
+
+        // strides along the stored axes, from the stored corner
+        long st[3] = {sx, sy, sz}, sst[3];
+        const V *base = data;
+        for (int i=0;i<3;i++) {
+            sst[orient.axis[i]] = st[i];
+            if (orient.flip & (1<<i)) {
+                base += (size-1)*st[i];
+                sst[orient.axis[i]] = -st[i];
             }
         }
+        long c[3] = {x, y, z}, e[3] = {x+size-1, y+size-1, z+size-1};
+        orient.apply(c[0], c[1], c[2], esize);
+        orient.apply(e[0], e[1], e[2], esize);
+        for (int i=0;i<3;i++) {
+            if (e[i] < c[i]) c[i] = e[i];
+        }
+
+        OctreeDenseVolume<V> vol(base, sst[0], sst[1], sst[2], d);
+        vol.classify(pool);
+
+        Node path[MAX_DEPTH+1];
+        path[0] = storage.root();
+        int top = depth-d;
+        for (int l=0;l<top;l++) {
+            if (!storage.hasChild(path[l])) storage.split(path[l]);
+            int b = depth-l-1;
+            int i = (int)(((c[0] >> b) & 1) | (((c[1] >> b) & 1) << 1) | (((c[2] >> b) & 1) << 2));
+            path[l+1] = storage.mutableChild(path[l], i);
+        }
+        storage.collapse(path[top], V());
+        fromDense(path[top], vol, 0, 0, 0, d, 0);
+
+        for (int l=top-1;l>=0;l--) {
+            Node ch = storage.child(path[l], 0);
+            if (storage.hasChild(ch)) break;
+            V v = storage.value(ch);
+            int i = 1;
+            for (;i<8;i++) {
+                ch = storage.child(path[l], i);
+                if (storage.hasChild(ch) || storage.value(ch) != v) break;
+            }
+            if (i < 8) break;
+            storage.collapse(path[l], v);
+        }
+        return OctreeBox(x, y, z, size, size, size);
+    }
+
+    // Whole tree, e.g. strides (1, size, size*size) for x fastest.
+    OctreeBox fromDense(const V *data, long sx, long sy, long sz, OctreeWorkerPool *pool = NULL) {
+        return fromDense(0, 0, 0, esize, data, sx, sy, sz, pool);
     }
 
     void serialize(std::vector<char> &buf) {
         buf.clear();
         buf.push_back(esize);
-        element.serialize(buf);
+        serialize(storage.root(), buf);
     }
 
     void unserialize(const std::vector<char> &buf) {
         int p=0;
         esize = buf[0];
         p++;
-        element.unserialize(buf,p);
+        orient = OctreeOrientation();
+        unserialize(storage.root(), buf, p);
     }
 
-    void get_slicez(V slice[],int p){
-    	int sz=size();
-	    for (int x=0;x<sz;x++) {
-	        for (int y=0;y<sz;y++) {
-	            slice[x+y*sz] = getValue(x,y,p);
-	        }
-	    }
+    // Writes the tree to a sink (see octree_stream.h). Returns false if
+    // the sink failed.
+    template<typename Sink>
+    bool save(Sink &sink) const {
+        OctreeStreamWriter<Sink> w(sink);
+        unsigned char header[8] = {'O', 'C', 'T', 'S', OCTREE_STREAM_VERSION, (unsigned char)depth,
+            (unsigned char)OctreeValueCodec<V>::id, (unsigned char)sizeof(V)};
+        w.put(header, 8);
+
+        Node root = storage.root();
+        if (!storage.hasChild(root)) {
+            w.byte(0);
+            OctreeValueCodec<V>::write(w, storage.value(root));
+            return w.finish();
+        }
+        w.byte(1);
+
+        // depth first without recursion. next: child to visit
+        struct Frame {
+            Node n;
+            int next;
+        } stack[MAX_DEPTH+1];
+        int sp = 0;
+        V last = V();
+        saveNode(w, root, last);
+        stack[sp].n = root;
+        stack[sp++].next = 0;
+        while (sp > 0) {
+            Frame &f = stack[sp-1];
+            Node c = Node();
+            while (f.next < 8 && !storage.hasChild(c = child(f.n, f.next))) f.next++;
+            if (f.next == 8) {
+                sp--;
+                continue;
+            }
+            f.next++;
+            saveNode(w, c, last);
+            stack[sp].n = c;
+            stack[sp++].next = 0;
+        }
+        return w.finish();
+    }
+
+    // Reads a tree written by save() for the same depth and value type.
+    // If the header does not match, the tree is unchanged; on a later
+    // error it is left empty. Returns false in both cases.
+    template<typename Source>
+    bool load(Source &src) {
+        OctreeStreamReader<Source> r(src);
+        unsigned char header[8];
+        r.get(header, 8);
+        if (!r.good() || memcmp(header, "OCTS", 4) != 0 || header[4] != OCTREE_STREAM_VERSION ||
+                header[5] != depth || header[6] != OctreeValueCodec<V>::id || header[7] != sizeof(V)) {
+            return false;
+        }
+        Node root = storage.root();
+        storage.collapse(root, V());
+        orient = OctreeOrientation();
+
+        if (r.byte() == 0) {
+            storage.collapse(root, OctreeValueCodec<V>::read(r));
+            if (r.good()) return true;
+            storage.collapse(root, V());
+            return false;
+        }
+
+        struct Frame {
+            Node n;
+            unsigned char mask;
+            int next;
+        } stack[MAX_DEPTH+1];
+        int sp = 0;
+        V last = V();
+        stack[sp].mask = loadNode(r, root, last);
+        stack[sp].n = root;
+        stack[sp++].next = 0;
+        while (sp > 0 && r.good()) {
+            Frame &f = stack[sp-1];
+            while (f.next < 8 && !(f.mask & (1<<f.next))) f.next++;
+            if (f.next == 8) {
+                sp--;
+                continue;
+            }
+            if (sp >= depth) break;
+            Node c = storage.mutableChild(f.n, f.next++);
+            stack[sp].mask = loadNode(r, c, last);
+            stack[sp].n = c;
+            stack[sp++].next = 0;
+        }
+        if (sp > 0 || !r.good()) {
+            storage.collapse(root, V());
+            return false;
+        }
+        return true;
+    }
+
+    // Writes the tree as VOXF (see octree_voxf.h).
+    bool saveVoxf(const char *path) const {
+        return voxf_write<V>(OctreeOrientedStorage<V, S>(storage, orient), storage.root(), depth, path, OctreeVoxfNoRef());
+    }
+
+    // Reads a VOXF file written for a tree of the same depth. The file is
+    // mapped and the tree is built in one pass over the NodeDesc array.
+    bool loadVoxf(const char *path) {
+        OctreeMappedFile f;
+        OctreeVoxfReader r;
+        if (!f.open(path) || !r.parse(f.data(), f.size())) return false;
+        if (r.max_depth == depth) orient = OctreeOrientation();
+        return voxf_read<V>(storage, storage.root(), depth, r, OctreeVoxfNoRef());
+    }
+
+    // Leaves as (x, y, z, size, value) for range-for and STL algorithms
+    // (see octree_iter.h):
+    //   for (auto &l : tree.leaves(box, 0)) volume += box.overlap(l.x, l.y, l.z, l.size);
+    // box: only the leaves intersecting it. skip: leaves with this value
+    // are left out.
+    OctreeLeafRange<V, S> leaves() const {
+        return OctreeLeafRange<V, S>(storage, depth, orient, OctreeBox(0, 0, 0, esize, esize, esize), false, V());
+    }
+    OctreeLeafRange<V, S> leaves(const OctreeBox &box) const {
+        return OctreeLeafRange<V, S>(storage, depth, orient, box, false, V());
+    }
+    OctreeLeafRange<V, S> leaves(const OctreeBox &box, const V &skip) const {
+        return OctreeLeafRange<V, S>(storage, depth, orient, box, true, skip);
     }
 
+    // Nodes and leaves per level, leaves and cells per value and the
+    // bytes held by the storage (see octree_stats.h). Walks the whole
+    // tree (and loads every page of OctreePagedStorage).
+    OctreeTreeStats<V> stats() const {
+        OctreeTreeStats<V> st(depth);
+        stats(storage.root(), 0, st);
+        st.bytes = octree_storage_bytes(storage);
+        return st;
+    }
+
+#if _OCTREE_STATS
+    // setValue calls and the splits and merges they made.
+    const OctreeEditStats& editStats() const {
+        return storage.editStats();
+    }
+#endif
+
+    // Cursor for runs of neighbor lookups (see octree_cursor.h). Valid
+    // until the tree changes.
+    OctreeCursor<V, S> cursor() const {
+        return OctreeCursor<V, S>(storage, depth, orient);
+    }
+
+    // First cell with a value other than V() on the ray (see
+    // octree_ray.h).
+    bool raycast(const OctreeRay &ray, OctreeRayHit &hit) const {
+        return octree_raycast<V>(OctreeOrientedStorage<V, S>(storage, orient), depth, ray, hit);
+    }
+
+    // Casts n rays in SIMD packets. Returns the number of hits.
+    long raycast(const OctreeRay *rays, OctreeRayHit *hits, long n) const {
+        return octree_raycast<V>(OctreeOrientedStorage<V, S>(storage, orient), depth, rays, hits, n);
+    }
+
+    // Copies the cells of box to out: cell (x,y,z) goes to
+    // out[(x-box.x1)*sx + (y-box.y1)*sy + (z-box.z1)*sz]. Only the nodes in
+    // the box are visited and leaves are filled as blocks (see
+    // octree_fill.h). Cells outside the tree are -1, as with getValue.
+    // With a pool, boxes of 64^3 cells or more are done in parallel over
+    // the octants of the root, unless octree_parallel_read(storage) is
+    // false (OctreePagedStorage, whose readers load pages).
+    void toDense(const OctreeBox &box, V *out, long sx, long sy, long sz, OctreeWorkerPool *pool = NULL) const {
+        if (box.empty()) return;
+        OctreeBox in((std::max)(box.x1, 0), (std::max)(box.y1, 0), (std::max)(box.z1, 0), 0, 0, 0);
+        in.x2 = (std::min)(box.x2, esize);
+        in.y2 = (std::min)(box.y2, esize);
+        in.z2 = (std::min)(box.z2, esize);
+        if (in.x1 != box.x1 || in.y1 != box.y1 || in.z1 != box.z1 || in.x2 != box.x2 || in.y2 != box.y2 || in.z2 != box.z2) {
+            octree_fill(out, box.x2-box.x1, box.y2-box.y1, box.z2-box.z1, sx, sy, sz, V(-1));
+            if (in.empty()) return;
+        }
+        out += (in.x1-box.x1)*sx + (in.y1-box.y1)*sy + (in.z1-box.z1)*sz;
+        const long st[3] = {sx, sy, sz};
+        Node root = storage.root();
+        long cells = (long)(in.x2-in.x1)*(in.y2-in.y1)*(in.z2-in.z1);
+        if (!pool || pool->size() == 1 || !octree_parallel_read(storage) || !storage.hasChild(root) || cells < 64*64*64) {
+            dense(root, 0, 0, 0, depth, in, out, st);
+            return;
+        }
+        long half = esize/2;
+        pool->run(8, [&](int i, int) {
+            long cx = half*(i&1), cy = half*((i>>1)&1), cz = half*((i>>2)&1);
+            if (in.intersects(cx, cy, cz, half)) dense(child(root, i), cx, cy, cz, depth-1, in, out, st);
+        });
+    }
+
+    // Whole tree, e.g. strides (1, size, size*size) for x fastest.
+    void toDense(V *out, long sx, long sy, long sz, OctreeWorkerPool *pool = NULL) const {
+        toDense(OctreeBox(0, 0, 0, esize, esize, esize), out, sx, sy, sz, pool);
+    }
+
+    // Copies the plane `p` along `axis` into buf (size*size, row stride
+    // `stride`). Cells are laid out as in get_slicex/y/z.
+    void get_slice(int axis, int p, V *buf, int stride) {
+        if (p<0 || p>=esize) {
+            octree_fill(buf, esize, esize, stride, V(-1));
+            return;
+        }
+        int c[3] = {0, 0, 0};
+        c[axis] = p;
+        slice(c, depth, axis, buf, stride);
+    }
+
+    // Copies the (1<<n)^2 square of the plane through (x,y,z) plus a 1 cell
+    // border (like Voxel.slice2). buf points to the border corner and must
+    // hold (size+2) rows. The square must be aligned to its size.
+    void get_slice2(int x, int y, int z, int n, int axis, V *buf, int stride) {
+        int size = 1 << n;
+        int c[3] = {x, y, z};
+        int ua = (axis+1)%3, va = (axis+2)%3;
+        int q[3];
+        q[axis] = c[axis];
+        for (int i=0;i<=size+1;i++) {
+            q[ua] = c[ua]+i-1;
+            q[va] = c[va]-1;
+            buf[i] = getValue(q[0], q[1], q[2]);
+            q[va] = c[va]+size;
+            buf[i+stride*(size+1)] = getValue(q[0], q[1], q[2]);
+            q[ua] = c[ua]-1;
+            q[va] = c[va]+i-1;
+            buf[i*stride] = getValue(q[0], q[1], q[2]);
+            q[ua] = c[ua]+size;
+            buf[i*stride+size+1] = getValue(q[0], q[1], q[2]);
+        }
+        buf += stride+1;
+        if (x<0 || x>=esize || y<0 || y>=esize || z<0 || z>=esize) {
+            octree_fill(buf, size, size, stride, V(-1));
+            return;
+        }
+        slice(c, n, axis, buf, stride);
+    }
+
+    void get_slicez(V slice[],int p){
+        get_slice(2, p, slice, esize);
+    }
 
     void get_slicex(V slice[],int p){
-    	int sz=size();
-	    for (int x=0;x<sz;x++) {
-	        for (int y=0;y<sz;y++) {
-	            slice[x+y*sz] = getValue(p,x,y);
-	        }
-	    }
+        get_slice(0, p, slice, esize);
     }
 
     void get_slicey(V slice[],int p){
-    	int sz=size();
-	    for (int x=0;x<sz;x++) {
-	        for (int y=0;y<sz;y++) {
-	            slice[x+y*sz] = getValue(y,p,x);
-	        }
-	    }
+        get_slice(1, p, slice, esize);
     }
 
 };
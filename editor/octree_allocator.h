@@ -0,0 +1,124 @@
+#ifndef _OCTREE_ALLOCATOR_H
+#define _OCTREE_ALLOCATOR_H
+
+#include <cstddef>
+#include <new>
+#include <vector>
+#include <type_traits>
+
+// Allocator policies for OctreeNode child blocks (8 nodes per block).
+//
+//  allocBlock()       : returns 8 default constructed nodes.
+//  freeBlock(b)       : b must not have children.
+//  releaseTree(root)  : frees every block below root.
+
+
+// new[] / delete[] per block.
+template <typename N>
+class OctreeHeapAllocator {
+    long live;
+public:
+    OctreeHeapAllocator() : live(0) {}
+
+    N* allocBlock() {
+        live++;
+        return new N[8];
+    }
+
+    void freeBlock(N* b) {
+        live--;
+        delete [] b;
+    }
+
+    void releaseTree(N &root) {
+        root.freeChildNodes(*this);
+    }
+
+    long blocksLive() const { return live; }
+    long blocksFree() const { return 0; }
+    size_t bytesReserved() const { return live * sizeof(N) * 8; }
+};
+
+
+// Slab allocator with a free list. Blocks are reused after merges and
+// releaseTree() drops all slabs at once.
+template <typename N, int SLAB_BLOCKS = 256>
+class OctreePoolAllocator {
+    struct FreeBlock {
+        FreeBlock *next;
+    };
+    static const size_t BLOCK_SIZE = sizeof(N) * 8;
+
+    std::vector<char*> slabs;
+    FreeBlock *free_list;
+    int slab_used;
+    long live;
+    long free_num;
+
+    OctreePoolAllocator(const OctreePoolAllocator&);
+    OctreePoolAllocator& operator=(const OctreePoolAllocator&);
+
+public:
+    OctreePoolAllocator() : free_list(NULL), slab_used(SLAB_BLOCKS), live(0), free_num(0) {}
+    ~OctreePoolAllocator() {
+        releaseAll();
+    }
+
+    N* allocBlock() {
+        void *p;
+        if (free_list) {
+            p = free_list;
+            free_list = free_list->next;
+            free_num--;
+        } else {
+            if (slab_used == SLAB_BLOCKS) {
+                slabs.push_back(static_cast<char*>(::operator new(BLOCK_SIZE * SLAB_BLOCKS)));
+                slab_used = 0;
+            }
+            p = slabs.back() + BLOCK_SIZE * slab_used++;
+        }
+        live++;
+        N *b = static_cast<N*>(p);
+        for (int i=0;i<8;i++) {
+            new (b+i) N();
+        }
+        return b;
+    }
+
+    void freeBlock(N* b) {
+        for (int i=0;i<8;i++) {
+            b[i].~N();
+        }
+        FreeBlock *f = new (b) FreeBlock;
+        f->next = free_list;
+        free_list = f;
+        live--;
+        free_num++;
+    }
+
+    void releaseTree(N &root) {
+        if (!std::is_trivially_destructible<typename N::ValueType>::value) {
+            root.freeChildNodes(*this);
+        }
+        root.child = NULL;
+        releaseAll();
+    }
+
+    // nodes in the pool are not destructed.
+    void releaseAll() {
+        for (size_t i=0;i<slabs.size();i++) {
+            ::operator delete(slabs[i]);
+        }
+        slabs.clear();
+        free_list = NULL;
+        slab_used = SLAB_BLOCKS;
+        live = 0;
+        free_num = 0;
+    }
+
+    long blocksLive() const { return live; }
+    long blocksFree() const { return free_num + (slabs.empty() ? 0 : SLAB_BLOCKS - slab_used); }
+    size_t bytesReserved() const { return slabs.size() * BLOCK_SIZE * SLAB_BLOCKS; }
+};
+
+#endif
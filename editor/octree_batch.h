@@ -0,0 +1,132 @@
+#ifndef _OCTREE_BATCH_H
+#define _OCTREE_BATCH_H
+
+#include <vector>
+#include <algorithm>
+#include <cstddef>
+#include <stdint.h>
+
+#if defined(__GNUC__)
+#define OCTREE_PREFETCH(p) __builtin_prefetch(p)
+#elif defined(_M_X64) || defined(_M_IX86)
+#include <xmmintrin.h>
+#define OCTREE_PREFETCH(p) _mm_prefetch((const char*)(p), _MM_HINT_T0)
+#else
+#define OCTREE_PREFETCH(p) ((void)0)
+#endif
+
+
+// Cell edit of Octree::setValues.
+template <typename V>
+struct OctreeEdit {
+    int x, y, z;
+    V value;
+};
+
+// Cell of Octree::getValues.
+struct OctreeCoord {
+    int x, y, z;
+};
+
+// Morton code of a cell (stored coordinates) and the index of its edit
+// or coordinate in the batch.
+struct OctreeMortonKey {
+    uint64_t code;
+    uint32_t i;
+};
+
+// Buffers of Octree::setValues and getValues. A caller doing many
+// batches keeps one (per thread) so they are allocated once.
+struct OctreeBatchBuffer {
+    std::vector<OctreeMortonKey> keys;
+    std::vector<OctreeMortonKey> tmp;
+};
+
+// Morton codes: bits 3l+2..3l of the code are the child index
+// (x|y<<1|z<<2) of the cell at l levels above the cells. Depth <= 21.
+struct OctreeMortonTable {
+    uint32_t t[256];  // bits of a byte to every third bit
+
+    OctreeMortonTable() {
+        for (int i=0;i<256;i++) {
+            t[i] = 0;
+            for (int b=0;b<8;b++) {
+                t[i] |= (uint32_t)((i >> b) & 1) << 3*b;
+            }
+        }
+    }
+
+    // low 21 bits of v to every third bit
+    inline uint64_t spread(uint64_t v) const {
+        return t[v & 255] | (uint64_t)t[(v >> 8) & 255] << 24 | (uint64_t)t[(v >> 16) & 31] << 48;
+    }
+    inline uint64_t code(uint64_t x, uint64_t y, uint64_t z) const {
+        return spread(x) | spread(y) << 1 | spread(z) << 2;
+    }
+};
+
+inline const OctreeMortonTable& octree_morton_table() {
+    static const OctreeMortonTable table;
+    return table;
+}
+
+inline uint64_t octree_morton(uint64_t x, uint64_t y, uint64_t z) {
+    return octree_morton_table().code(x, y, z);
+}
+
+// Levels above the cells of the smallest cube holding both cells.
+inline int octree_morton_level(uint64_t a, uint64_t b) {
+    uint64_t v = a ^ b;
+#if defined(__GNUC__)
+    int n = v ? 64 - __builtin_clzll(v) : 0;
+#else
+    int n = 0;
+    for (;v;v>>=1) n++;
+#endif
+    return (n + 2) / 3;
+}
+
+// Sorts k by the codes. Stable: the keys of a cell keep the order of the
+// batch. LSD radix sort, 11 bits per pass; passes over bits that are the
+// same in every code are skipped (a batch in a small region needs one or
+// two). tmp is scratch.
+inline void octree_morton_sort(std::vector<OctreeMortonKey> &k, std::vector<OctreeMortonKey> &tmp) {
+    uint64_t diff = 0;
+    bool sorted = true;
+    for (size_t j=1;j<k.size();j++) {
+        diff |= k[j].code ^ k[0].code;
+        sorted &= k[j-1].code <= k[j].code;
+    }
+    if (sorted) return;
+    if (k.size() < 256) {
+        std::stable_sort(k.begin(), k.end(), [](const OctreeMortonKey &a, const OctreeMortonKey &b) {
+            return a.code < b.code;
+        });
+        return;
+    }
+    const int R = 11;
+    tmp.resize(k.size());
+    for (int s=0;s<64;s+=R) {
+        if (!((diff >> s) & ((1<<R)-1))) continue;
+        size_t count[(1<<R)+1] = {0};
+        for (size_t j=0;j<k.size();j++) {
+            count[((k[j].code >> s) & ((1<<R)-1)) + 1]++;
+        }
+        for (int d=0;d<(1<<R);d++) {
+            count[d+1] += count[d];
+        }
+        for (size_t j=0;j<k.size();j++) {
+            tmp[count[(k[j].code >> s) & ((1<<R)-1)]++] = k[j];
+        }
+        k.swap(tmp);
+    }
+}
+
+// Asks for the child block of child i of n before it is visited
+// (Octree::getValues, setValues). Storages overload it next to their
+// class; found at instantiation by ADL.
+template <typename S>
+inline void octree_prefetch(const S &, typename S::Node, int) {
+}
+
+#endif
@@ -0,0 +1,830 @@
+// Benchmarks for the octree and the mesher (like js/octree-bench.js).
+// Headless, a target of its own:
+//
+//   g++ -O2 -std=c++11 -pthread octree_bench.cpp -o octree_bench
+//   ./octree_bench [depth] [threads] [--depths 5,7,9] [--time ms] [--json file]
+//
+// depth: the mesh, ray and storage cases (default 9). --depths: the core
+// Octree cases (setValue/getValue, scrapeSphere, slices, serialize,
+// rotate_z, make_vartex) run at each of them (default 5, 7 and depth).
+// --time: minimum time per case in ms (default 1000). --json: results as
+// JSON for tracking regressions ("-" for stdout, the table goes to
+// stderr).
+//
+// Every case reports ms per run, ns per op and ops per second, where an
+// op is a cell, a node, a ray... (see the unit), and the peak resident
+// memory while it ran (Linux; elsewhere the peak of the process so far).
+//
+// -D_OCTREE_NODE_PARENT_REF=1 measures OctreeNode with parent links.
+// -D_OCTREE_STATS=1 adds the setValue splits/merges and the time of the
+// mesher phases (see octree_stats.h) to the cases.
+//
+// The CONCURRENT cases are also the stress run of OctreeConcurrentStorage:
+// readers check every tree they see. Under ThreadSanitizer:
+//
+//   g++ -O1 -g -std=c++11 -fsanitize=thread -pthread octree_bench.cpp -o octree_bench_tsan
+//   ./octree_bench_tsan 7 4 --depths 5 --time 200
+//
+// The PAGED cases write a world of OctreePagedStorage to
+// octree_bench_world.voxf* in the current directory (removed at the end)
+// and check that missing or broken page files read as empty pages.
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cmath>
+#include <ctime>
+#include <chrono>
+#include <thread>
+#include <atomic>
+#include <functional>
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/resource.h>
+#endif
+
+#define OCTREE_NO_GL
+#include "gloctree.h"
+#include "octree_concurrent.h"
+#include "octree_paged.h"
+
+using namespace std;
+
+static FILE *out = stdout;
+static double min_time = 1000;
+
+struct Result {
+    string name;
+    int depth;
+    int runs;
+    double ms;   // per run
+    double ops;  // per run
+    string unit;
+    long peak_kb;
+    vector<pair<string, double> > extra;
+};
+static vector<Result> results;
+
+static double now_ms(){
+    return chrono::duration<double, milli>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Peak resident memory in KB. On Linux the peak is reset before each
+// case (clear_refs), elsewhere it is the peak of the process so far.
+static void peak_reset(){
+#if defined(__linux__)
+    FILE *f = fopen("/proc/self/clear_refs", "w");
+    if (f) {
+        fputs("5", f);
+        fclose(f);
+    }
+#endif
+}
+
+static long peak_kb(){
+#if defined(__linux__)
+    FILE *f = fopen("/proc/self/status", "r");
+    if (f) {
+        char line[256];
+        long kb = -1;
+        while (fgets(line, sizeof(line), f)) {
+            if (sscanf(line, "VmHWM: %ld", &kb) == 1) break;
+        }
+        fclose(f);
+        if (kb >= 0) return kb;
+    }
+#endif
+#if defined(__unix__) || defined(__APPLE__)
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+#if defined(__APPLE__)
+    return ru.ru_maxrss / 1024;
+#else
+    return ru.ru_maxrss;
+#endif
+#else
+    return 0;
+#endif
+}
+
+// Runs f until at least min_time (and 3 runs) have passed. ops: the work
+// of one run in units. Returns ms per run.
+static double bench(const char *name, int depth, double ops, const char *unit, const function<void()> &f){
+    peak_reset();
+    f();
+    int n = 0;
+    double t0 = now_ms(), t;
+    do {
+        f();
+        n++;
+        t = now_ms() - t0;
+    } while (t < min_time || n < 3);
+    Result r;
+    r.name = name;
+    r.depth = depth;
+    r.runs = n;
+    r.ms = t/n;
+    r.ops = ops;
+    r.unit = unit;
+    r.peak_kb = peak_kb();
+    results.push_back(r);
+    fprintf(out, "%-32s d%-2d %10.3f ms/op %10.1f ns/%-5s %9.3f M%s/s %8ld KB (%d runs)\n",
+        name, depth, r.ms, r.ms*1e6/ops, unit, ops/r.ms/1000, unit, r.peak_kb, n);
+    return t/n;
+}
+
+static double bench(const char *name, int depth, const function<void()> &f){
+    return bench(name, depth, 1, "run", f);
+}
+
+// Derived value of the last case (speedup, size...).
+static void extra(const char *key, double v, const char *fmt = "%10.2f %s\n"){
+    results.back().extra.push_back(make_pair(string(key), v));
+    fprintf(out, "%-36s", "");
+    fprintf(out, fmt, v, key);
+}
+
+static string json_escape(const string &s){
+    string r;
+    for (size_t i=0;i<s.size();i++) {
+        if (s[i] == '"' || s[i] == '\\') r += '\\';
+        r += s[i];
+    }
+    return r;
+}
+
+static bool write_json(const char *path, int threads){
+    FILE *f = strcmp(path, "-") == 0 ? stdout : fopen(path, "w");
+    if (!f) return false;
+    char date[32];
+    time_t tt = time(NULL);
+    strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%SZ", gmtime(&tt));
+    const char *simd = _OCTREE_RAY_AVX2 ? "avx2" : _OCTREE_RAY_SSE ? "sse2" : "scalar";
+#if defined(__clang__)
+    const char *compiler = "clang " __clang_version__;
+#elif defined(__GNUC__)
+    const char *compiler = "gcc " __VERSION__;
+#elif defined(_MSC_VER)
+    const char *compiler = "msvc";
+#else
+    const char *compiler = "unknown";
+#endif
+    fprintf(f, "{\n  \"suite\": \"octree_bench\",\n  \"version\": 1,\n  \"date\": \"%s\",\n", date);
+    fprintf(f, "  \"compiler\": \"%s\",\n  \"simd\": \"%s\",\n  \"threads\": %d,\n", json_escape(compiler).c_str(), simd, threads);
+    fprintf(f, "  \"node_bytes\": %d,\n  \"results\": [\n", (int)sizeof(OctreeNode<ValueType>));
+    for (size_t i=0;i<results.size();i++) {
+        const Result &r = results[i];
+        fprintf(f, "    {\"name\": \"%s\", \"depth\": %d, \"runs\": %d, \"ms_per_run\": %.6g, \"unit\": \"%s\", "
+            "\"ops_per_run\": %.6g, \"ns_per_op\": %.6g, \"ops_per_sec\": %.6g, \"peak_rss_kb\": %ld",
+            json_escape(r.name).c_str(), r.depth, r.runs, r.ms, r.unit.c_str(), r.ops, r.ms*1e6/r.ops, r.ops/r.ms*1000, r.peak_kb);
+        for (size_t k=0;k<r.extra.size();k++) {
+            fprintf(f, ", \"%s\": %.6g", json_escape(r.extra[k].first).c_str(), r.extra[k].second);
+        }
+        fprintf(f, "}%s\n", i+1 < results.size() ? "," : "");
+    }
+    fprintf(f, "  ]\n}\n");
+    if (f != stdout) fclose(f);
+    return true;
+}
+
+// Splits and merges per setValue of t (with _OCTREE_STATS).
+template<typename T>
+static void edit_extras(const T &t){
+#if _OCTREE_STATS
+    const OctreeEditStats &e = t.editStats();
+    extra("splits/set", e.sets ? (double)e.splits/e.sets : 0);
+    extra("merges/set", e.sets ? (double)e.merges/e.sets : 0);
+#else
+    (void)t;
+#endif
+}
+
+// Phases of the last mesher run (with _OCTREE_STATS).
+static void mesh_extras(const OctreeMeshStats &s){
+#if _OCTREE_STATS
+    extra("ms traversal", s.traversal*1000);
+    extra("ms neighbors", s.neighbors*1000);
+    extra("ms adjust", s.adjust*1000);
+    extra("ms emission", s.emission*1000);
+#else
+    (void)s;
+#endif
+}
+
+// Octree API at one depth: point edits and lookups, spheres, slices,
+// serialization, rotation and the meshers.
+static long core(int depth){
+    typedef Octree<ValueType> Tree;
+    int size = 1 << depth;
+    int sz = size / 2;
+    Tree voxel(depth, 0);
+    voxel.sphere(sz, sz, sz, sz - 2, 1);
+    voxel.scrapeSphere(sz + sz/2, sz, sz, sz/3);
+    long nodes = (long)voxel.stats().nodeCount();
+    fprintf(out, "-- depth %d, %ld nodes\n", depth, nodes);
+
+    // random cells, and a box on the surface scanned x fastest
+    const int rn = 100000;
+    vector<int> rc(rn*3);
+    srand(1);
+    for (int i=0;i<rn*3;i++) rc[i] = rand() % size;
+    int cb = min(64, size);
+    int c0 = sz - cb/2;
+    double cn = (double)cb*cb*cb;
+    long gsum = 0;
+
+    bench("OCTREE:getValue random", depth, rn, "op", [&]() {
+        for (int i=0;i<rn;i++) gsum += voxel.getValue(rc[i*3], rc[i*3+1], rc[i*3+2]);
+    });
+    bench("OCTREE:getValue coherent", depth, cn, "op", [&]() {
+        for (int z=c0;z<c0+cb;z++) {
+            for (int y=c0;y<c0+cb;y++) {
+                for (int x=c0;x<c0+cb;x++) gsum += voxel.getValue(x, y, z);
+            }
+        }
+    });
+    {
+        Tree t(depth, 0);
+        int k = 0;
+        bench("OCTREE:setValue random", depth, rn, "op", [&]() {
+            k++;
+            for (int i=0;i<rn;i++) t.setValue(rc[i*3], rc[i*3+1], rc[i*3+2], (i+k)&1);
+        });
+        edit_extras(t);
+    }
+    {
+        Tree t(depth, 0);
+        int k = 0;
+        bench("OCTREE:setValue coherent", depth, cn, "op", [&]() {
+            k++;
+            for (int z=c0;z<c0+cb;z++) {
+                for (int y=c0;y<c0+cb;y++) {
+                    for (int x=c0;x<c0+cb;x++) t.setValue(x, y, z, ((x^y^z)&4) ? k&1 : 1);
+                }
+            }
+        });
+        edit_extras(t);
+    }
+
+    // batches of 10k edits, per call and with setValues: a brush stroke
+    // (a ball of radius 2 moved one cell at a time along a random walk on
+    // the surface) painting one value, and random cells of both values.
+    // Then lookups of the same cells.
+    {
+        const int bn = 10000;
+        char name[64];
+        vector<OctreeEdit<ValueType> > stroke, scatter;
+        int p[3] = {sz, sz, sz + sz - 2};
+        srand(2);
+        while ((int)stroke.size() < bn) {
+            int a = rand() % 3;
+            p[a] = max(2, min(size-3, p[a] + (rand() & 1 ? 1 : -1)));
+            for (int z=-2;z<=2;z++) {
+                for (int y=-2;y<=2;y++) {
+                    for (int x=-2;x<=2;x++) {
+                        if (x*x+y*y+z*z > 4 || (int)stroke.size() == bn) continue;
+                        OctreeEdit<ValueType> e = {p[0]+x, p[1]+y, p[2]+z, 0};
+                        stroke.push_back(e);
+                    }
+                }
+            }
+        }
+        for (int i=0;i<bn;i++) {
+            OctreeEdit<ValueType> e = {rc[i*3], rc[i*3+1], rc[i*3+2], 0};
+            scatter.push_back(e);
+        }
+        vector<OctreeEdit<ValueType> > *batches[2] = {&stroke, &scatter};
+        const char *kinds[2] = {"stroke", "random"};
+        OctreeBatchBuffer buf;
+        for (int b=0;b<2;b++) {
+            vector<OctreeEdit<ValueType> > &ed = *batches[b];
+            Tree t1(depth, 0), t2(depth, 0);
+            t1.sphere(sz, sz, sz, sz - 2, 1);
+            t2.sphere(sz, sz, sz, sz - 2, 1);
+            int k = 0;
+            sprintf(name, "BATCH:setValue %s", kinds[b]);
+            double tg = bench(name, depth, bn, "op", [&]() {
+                k++;
+                for (int i=0;i<bn;i++) t1.setValue(ed[i].x, ed[i].y, ed[i].z, (b ? i+k : k)&1);
+            });
+            k = 0;
+            sprintf(name, "BATCH:setValues %s", kinds[b]);
+            double tc = bench(name, depth, bn, "op", [&]() {
+                k++;
+                for (int i=0;i<bn;i++) ed[i].value = (b ? i+k : k)&1;
+                t2.setValues(&ed[0], bn, buf);
+            });
+            extra("speedup", tg/tc);
+
+            vector<OctreeCoord> cs(bn);
+            for (int i=0;i<bn;i++) {
+                OctreeCoord c = {ed[i].x, ed[i].y, ed[i].z};
+                cs[i] = c;
+            }
+            vector<ValueType> vals(bn);
+            sprintf(name, "BATCH:getValue %s", kinds[b]);
+            tg = bench(name, depth, bn, "op", [&]() {
+                for (int i=0;i<bn;i++) vals[i] = voxel.getValue(cs[i].x, cs[i].y, cs[i].z);
+            });
+            sprintf(name, "BATCH:getValues %s", kinds[b]);
+            tc = bench(name, depth, bn, "op", [&]() {
+                voxel.getValues(&cs[0], bn, &vals[0], buf);
+            });
+            extra("speedup", tg/tc);
+        }
+    }
+
+    bench("OCTREE:scrapeSphere", depth, nodes, "node", [&]() {
+        Tree t(depth, 0);
+        t.sphere(sz, sz, sz, sz - 2, 1);
+        t.scrapeSphere(sz + sz/2, sz, sz, sz/3);
+    });
+
+    vector<ValueType> slice((size_t)size*size);
+    bench("OCTREE:get_slicex", depth, size, "slice", [&]() {
+        for (int p=0;p<size;p++) voxel.get_slicex(&slice[0], p);
+    });
+    bench("OCTREE:get_slicey", depth, size, "slice", [&]() {
+        for (int p=0;p<size;p++) voxel.get_slicey(&slice[0], p);
+    });
+    bench("OCTREE:get_slicez", depth, size, "slice", [&]() {
+        for (int p=0;p<size;p++) voxel.get_slicez(&slice[0], p);
+    });
+    {
+        // 16x16 squares with a border over the middle plane
+        int n = min(4, depth);
+        int sq = 1 << n;
+        vector<ValueType> buf((sq+2)*(sq+2));
+        double squares = (double)(size/sq)*(size/sq);
+        bench("OCTREE:get_slice2", depth, squares, "slice", [&]() {
+            for (int v=0;v<size;v+=sq) {
+                for (int u=0;u<size;u+=sq) voxel.get_slice2(u, v, sz, n, 2, &buf[0], sq+2);
+            }
+        });
+    }
+
+    vector<char> buf;
+    bench("OCTREE:serialize", depth, nodes, "node", [&]() {
+        voxel.serialize(buf);
+    });
+    extra("KB", buf.size() / 1024.0, "%10.1f %s\n");
+    {
+        Tree t(depth, 0);
+        bench("OCTREE:unserialize", depth, nodes, "node", [&]() {
+            t.unserialize(buf);
+        });
+    }
+
+    // O(1) since the orientation; bake() rewrites the storage
+    bench("OCTREE:rotate_z", depth, [&]() {
+        voxel.rotate_z();
+    });
+    {
+        Tree t(depth, 0);
+        t.sphere(sz, sz, sz, sz - 2, 1);
+        t.scrapeSphere(sz + sz/2, sz, sz, sz/3);
+        bench("OCTREE:rotate_z+bake", depth, nodes, "node", [&]() {
+            t.rotate_z();
+            t.bake();
+        });
+    }
+
+    OctreeTreeStats<ValueType> st;
+    bench("OCTREE:stats", depth, nodes, "node", [&]() {
+        st = voxel.stats();
+    });
+    extra("height", st.height(), "%10.0f %s\n");
+    extra("KB", st.bytes / 1024.0, "%10.1f %s\n");
+
+    GLOctree gl(depth, 0);
+    gl.sphere(sz, sz, sz, sz - 2, 1);
+    gl.scrapeSphere(sz + sz/2, sz, sz, sz/3);
+    bench("VOXEL:make_vartex", depth, nodes, "node", [&]() {
+        gl.make_vartex();
+    });
+    extra("vertices", (double)gl.meshStats().verts, "%10.0f %s\n");
+    mesh_extras(gl.meshStats());
+    bench("VOXEL:make_vartex2", depth, nodes, "node", [&]() {
+        gl.clearMesh();
+        gl.make_vartex2();
+    });
+    mesh_extras(gl.meshStats());
+    return gsum;
+}
+
+int main(int argc, char *argv[]){
+    int depth = 9;
+    int max_threads = (int)thread::hardware_concurrency();
+    vector<int> depths;
+    const char *json = NULL;
+    int pos = 0;
+    for (int i=1;i<argc;i++) {
+        if (strcmp(argv[i], "--json") == 0 && i+1 < argc) {
+            json = argv[++i];
+        } else if (strcmp(argv[i], "--time") == 0 && i+1 < argc) {
+            min_time = atof(argv[++i]);
+        } else if (strcmp(argv[i], "--depths") == 0 && i+1 < argc) {
+            for (const char *p=argv[++i];*p;) {
+                depths.push_back(atoi(p));
+                while (*p && *p != ',') p++;
+                if (*p) p++;
+            }
+        } else if (pos < 2 && argv[i][0] != '-') {
+            if (pos++ == 0) {
+                depth = atoi(argv[i]);
+            } else {
+                max_threads = atoi(argv[i]);
+            }
+        } else {
+            fprintf(stderr, "usage: %s [depth] [threads] [--depths 5,7,9] [--time ms] [--json file]\n", argv[0]);
+            return 2;
+        }
+    }
+    if (max_threads <= 0) max_threads = 1;
+    if (json && strcmp(json, "-") == 0) out = stderr;
+    if (depths.empty()) {
+        if (depth > 5) depths.push_back(5);
+        if (depth > 7) depths.push_back(7);
+        depths.push_back(depth);
+    }
+
+    long nsum = 0;
+    for (size_t i=0;i<depths.size();i++) {
+        nsum += core(depths[i]);
+    }
+
+    GLOctree voxel(depth, 0);
+    int sz = voxel.size() / 2;
+    voxel.sphere(sz, sz, sz, sz - 2, 1);
+    voxel.scrapeSphere(sz + sz/2, sz, sz, sz/3);
+    long verts = voxel.make_vartex2();
+    long nodes = (long)voxel.stats().nodeCount();
+    fprintf(out, "-- depth %d, %ld nodes, %ld vertices\n", depth, nodes, verts);
+
+    char name[64];
+
+    // mesh: full rebuild with 1..N workers.
+    double base = 0;
+    for (int n=1;;n=(n*2 < max_threads ? n*2 : max_threads)) {
+        OctreeWorkerPool pool(n);
+        voxel.setWorkerPool(&pool);
+        sprintf(name, "VOXEL:mesh %d thread(s)", n);
+        double t = bench(name, depth, nodes, "node", [&]() {
+            voxel.clearMesh();
+            if (voxel.make_vartex2() != verts) {
+                fprintf(stderr, "vertex count mismatch\n");
+                exit(1);
+            }
+        });
+        if (n == 1) base = t;
+        extra("speedup", base/t);
+        voxel.setWorkerPool(NULL);
+        if (n == max_threads) break;
+    }
+
+    // mesh formats: time and memory
+    const char *formats[] = {"triangles", "indexed", "quantized"};
+    for (int f=GLOctree::MESH_TRIANGLES;f<=GLOctree::MESH_QUANTIZED;f++) {
+        voxel.setMeshFormat(f);
+        sprintf(name, "VOXEL:mesh %s", formats[f]);
+        bench(name, depth, nodes, "node", [&]() {
+            voxel.clearMesh();
+            voxel.make_vartex2();
+        });
+        extra("MB", voxel.meshBytes() / 1048576.0);
+    }
+    voxel.setMeshFormat(GLOctree::MESH_TRIANGLES);
+    voxel.make_vartex2();
+
+    bench("VOXEL:mesh cached", depth, [&]() {
+        voxel.make_vartex2();
+    });
+
+    bench("VOXEL:setValue+mesh", depth, [&]() {
+        static int k = 0;
+        voxel.setValue(sz + k%7, sz, 4 + k%3, (k&1));
+        k++;
+        voxel.make_vartex2();
+    });
+
+    bench("VOXEL:sphere", depth, [&]() {
+        GLOctree v(depth, 0);
+        int s = v.size();
+        v.sphere(s/2, s/2, s/2, 10, 1);
+    });
+
+    // 6 face neighbors of each cell of a 64^3 box on the surface, from
+    // the root each time and with a cursor.
+    int nb = min(64, voxel.size());
+    int nb0 = sz - nb/2;
+    double nbn = 6.0*nb*nb*nb;
+    double t;
+    double tg = bench("VOXEL:neighbors getValue", depth, nbn, "op", [&]() {
+        for (int z=nb0;z<nb0+nb;z++) {
+            for (int y=nb0;y<nb0+nb;y++) {
+                for (int x=nb0;x<nb0+nb;x++) {
+                    nsum += voxel.getValue(x-1, y, z) + voxel.getValue(x+1, y, z) + voxel.getValue(x, y-1, z) +
+                        voxel.getValue(x, y+1, z) + voxel.getValue(x, y, z-1) + voxel.getValue(x, y, z+1);
+                }
+            }
+        }
+    });
+    double tc = bench("VOXEL:neighbors cursor", depth, nbn, "op", [&]() {
+        OctreeCursor<ValueType, OctreeSharedStorage<ValueType> > c = voxel.cursor();
+        for (int z=nb0;z<nb0+nb;z++) {
+            for (int y=nb0;y<nb0+nb;y++) {
+                for (int x=nb0;x<nb0+nb;x++) {
+                    nsum += c.at(x-1, y, z) + c.at(x+1, y, z) + c.at(x, y-1, z) +
+                        c.at(x, y+1, z) + c.at(x, y, z-1) + c.at(x, y, z+1);
+                }
+            }
+        }
+    });
+    extra("speedup", tg/tc);
+
+    // solid volume in the same box, cell by cell and by leaves
+    OctreeBox box(nb0, nb0, nb0, nb, nb, nb);
+    double boxn = (double)nb*nb*nb;
+    long vol = 0;
+    tg = bench("LEAF:volume getValue", depth, boxn, "cell", [&]() {
+        vol = 0;
+        for (int z=box.z1;z<box.z2;z++) {
+            for (int y=box.y1;y<box.y2;y++) {
+                for (int x=box.x1;x<box.x2;x++) {
+                    vol += voxel.getValue(x, y, z) > 0;
+                }
+            }
+        }
+    });
+    long vol2 = 0;
+    tc = bench("LEAF:volume leaves", depth, boxn, "cell", [&]() {
+        vol2 = 0;
+        for (auto &l : voxel.leaves(box, 0)) vol2 += box.overlap(l.x, l.y, l.z, l.size);
+    });
+    extra("speedup", tg/tc);
+    if (vol != vol2) {
+        fprintf(stderr, "volume mismatch\n");
+        exit(1);
+    }
+    long leaf_num = 0;
+    bench("LEAF:count all", depth, nodes, "node", [&]() {
+        leaf_num = distance(voxel.leaves().begin(), voxel.leaves().end());
+    });
+    extra("leaves", (double)leaf_num, "%10.0f %s\n");
+
+    // dense copy of a 128^3 box on the surface, cell by cell and with
+    // toDense (1 and N threads)
+    int db = min(128, voxel.size());
+    OctreeBox dbox(sz - db/2, sz - db/2, sz - db/2, db, db, db);
+    double dbn = (double)db*db*db;
+    vector<ValueType> dense((size_t)db*db*db), dense2(dense.size());
+    tg = bench("DENSE:box getValue", depth, dbn, "cell", [&]() {
+        ValueType *p = &dense[0];
+        for (int z=dbox.z1;z<dbox.z2;z++) {
+            for (int y=dbox.y1;y<dbox.y2;y++) {
+                for (int x=dbox.x1;x<dbox.x2;x++) {
+                    *p++ = voxel.getValue(x, y, z);
+                }
+            }
+        }
+    });
+    tc = bench("DENSE:box toDense", depth, dbn, "cell", [&]() {
+        voxel.toDense(dbox, &dense2[0], 1, db, (long)db*db);
+    });
+    extra("speedup", tg/tc);
+    if (dense != dense2) {
+        fprintf(stderr, "dense mismatch\n");
+        exit(1);
+    }
+    {
+        OctreeWorkerPool pool(max_threads);
+        sprintf(name, "DENSE:box toDense %d thread(s)", max_threads);
+        t = bench(name, depth, dbn, "cell", [&]() {
+            voxel.toDense(dbox, &dense2[0], 1, db, (long)db*db, &pool);
+        });
+        extra("speedup", tg/t);
+    }
+
+    // One writer and readers without locks (see octree_concurrent.h):
+    // random lookups alone and while a writer thread keeps calling
+    // setValue, then walks over all leaves. Readers count every value out
+    // of range and every tree whose leaves do not tile the cube.
+    {
+        typedef Octree<ValueType, OctreeConcurrentStorage<ValueType> > CTree;
+        CTree ct(depth, 0);
+        int s = ct.size();
+        ct.sphere(s/2, s/2, s/2, s/2 - 2, 1);
+        ct.scrapeSphere(s/2 + s/4, s/2, s/2, s/6);
+        ct.getStorage().reclaim();
+        int readers = max_threads > 1 ? max_threads - 1 : 1;
+        OctreeWorkerPool pool(readers);
+        vector<OctreeEpochs::Reader*> rd;
+        for (int i=0;i<readers;i++) {
+            rd.push_back(new OctreeEpochs::Reader(ct.getStorage().epochs()));
+        }
+        const int batch = 1 << 14;
+        vector<int> rc(batch*3);
+        srand(5);
+        for (size_t i=0;i<rc.size();i++) rc[i] = rand() % s;
+        atomic<long> bad(0);
+        // a task: one batch of lookups under one guard
+        function<void(int,int)> lookups = [&](int, int w) {
+            OctreeEpochs::Guard g(*rd[w]);
+            long b = 0;
+            for (int i=0;i<batch;i++) {
+                ValueType v = ct.getValue(rc[i*3], rc[i*3+1], rc[i*3+2]);
+                b += v < 0 || v > 2;
+            }
+            if (b) bad += b;
+        };
+        function<void(int,int)> walk = [&](int, int w) {
+            OctreeEpochs::Guard g(*rd[w]);
+            long cells = 0;
+            for (auto &l : ct.leaves()) {
+                cells += l.size*l.size*l.size;
+                if (l.value < 0 || l.value > 2) bad++;
+            }
+            if (cells != (long)s*s*s) bad++;
+        };
+
+        sprintf(name, "CONCURRENT:getValue %d reader(s)", readers);
+        double tr = bench(name, depth, (double)batch*readers, "op", [&]() {
+            pool.run(readers, lookups);
+        });
+
+        atomic<bool> stop(false);
+        atomic<long> edits(0);
+        thread writer([&]() {
+            unsigned r = 7;
+            long n = 0;
+            while (!stop.load(memory_order_relaxed)) {
+                int c[3];
+                for (int k=0;k<3;k++) {
+                    r = r*1103515245 + 12345;
+                    c[k] = (int)((r >> 8) % s);
+                }
+                ct.setValue(c[0], c[1], c[2], 1 + ((r >> 4) & 1));
+                if ((++n & 1023) == 0) edits.store(n, memory_order_relaxed);
+            }
+        });
+        double w0 = now_ms();
+        double tw = bench("CONCURRENT:getValue +writer", depth, (double)batch*readers, "op", [&]() {
+            pool.run(readers, lookups);
+        });
+        extra("slowdown", tw/tr);
+        extra("writer Mop/s", edits.load() / (now_ms() - w0) / 1000, "%10.3f %s\n");
+        bench("CONCURRENT:leaves +writer", depth, readers, "tree", [&]() {
+            pool.run(readers, walk);
+        });
+        stop = true;
+        writer.join();
+        for (int i=0;i<readers;i++) delete rd[i];
+        if (bad.load()) {
+            fprintf(stderr, "concurrent readers saw %ld broken values or trees\n", bad.load());
+            exit(1);
+        }
+    }
+
+    // OctreeNode storage, see _OCTREE_NODE_PARENT_REF
+    bench("NODE:sphere", depth, [&]() {
+        Octree<ValueType> v(depth, 0);
+        int s = v.size();
+        v.sphere(s/2, s/2, s/2, s/2 - 2, 1);
+    });
+    extra("bytes/node", (double)sizeof(OctreeNode<ValueType>), "%10.0f %s\n");
+
+    // OctreePagedStorage: a world of 64 pages, lookups with every page
+    // loaded, then with a budget of a few pages (pages are read again and
+    // dropped). Then two page files are lost: their pages must read as
+    // empty, the others as before.
+    {
+        typedef Octree<ValueType, OctreePagedStorage<ValueType> > PTree;
+        const char *world = "octree_bench_world.voxf";
+        int pd = min(depth, 7);
+        PTree pt(pd, 0);
+        int s = pt.size();
+        pt.sphere(s/2, s/2, s/2, s/2 - 2, 1);
+        pt.scrapeSphere(s/2 + s/4, s/2, s/2, s/6);
+        vector<ValueType> ref((size_t)s*s*s), got(ref.size());
+        pt.toDense(&ref[0], 1, s, (long)s*s);
+        long pages = 0;
+        if (pt.getStorage().create(world, pd, 2) && pt.getStorage().flush()) {
+            pages = pt.getStorage().stats().pages;
+        }
+        if (pages == 0) {
+            fprintf(stderr, "cannot write %s\n", world);
+            exit(1);
+        }
+        const int batch = 1 << 14;
+        vector<int> rc(batch*3);
+        srand(6);
+        for (size_t i=0;i<rc.size();i++) rc[i] = rand() % s;
+        auto lookups = [&](PTree &t, int n) {
+            for (int i=0;i<n;i++) nsum += t.getValue(rc[i*3], rc[i*3+1], rc[i*3+2]);
+        };
+        bench("PAGED:getValue loaded", pd, batch, "op", [&]() {
+            lookups(pt, batch);
+        });
+        {
+            PTree q(pd, 0);
+            q.getStorage().setMemoryBudget(pt.getStorage().stats().bytes / 16);
+            q.getStorage().open(world, pd, 2);
+            // most lookups read a page: fewer of them
+            bench("PAGED:getValue 1/16 budget", pd, batch/16, "op", [&]() {
+                lookups(q, batch/16);
+            });
+            OctreePageStats st = q.getStorage().stats();
+            extra("misses/run", (double)st.misses / (results.back().runs + 1), "%10.1f %s\n");
+        }
+
+        // page files .0 and .1: one missing, one broken
+        char file[64];
+        sprintf(file, "%s.0", world);
+        remove(file);
+        sprintf(file, "%s.1", world);
+        if (FILE *f = fopen(file, "wb")) {
+            fputs("broken", f);
+            fclose(f);
+        }
+        PTree q(pd, 0);
+        q.getStorage().open(world, pd, 2);
+        q.toDense(&got[0], 1, s, (long)s*s);
+        long lost = 0, diff = 0;
+        for (int z=0;z<s;z++) {
+            for (int y=0;y<s;y++) {
+                for (int x=0;x<s;x++) {
+                    size_t k = x + (size_t)y*s + (size_t)z*s*s;
+                    ValueType v = q.getValue(x, y, z);
+                    lost += v != ref[k];
+                    diff += v != got[k] || (v != ref[k] && v != 0);
+                }
+            }
+        }
+        if (diff || !lost || q.getStorage().stats().errors != 2) {
+            fprintf(stderr, "paged world with lost pages: %ld broken cells, %ld errors\n", diff, q.getStorage().stats().errors);
+            exit(1);
+        }
+        remove(world);
+        for (long i=0;i<pages;i++) {
+            sprintf(file, "%s.%ld", world, i);
+            remove(file);
+        }
+
+        // a world built by setValue: pages are made and grow without a
+        // page being read, the budget still holds.
+        PTree g(pd, 0);
+        g.getStorage().create(world, pd, 2);
+        g.getStorage().setMemoryBudget(pt.getStorage().stats().bytes / 16);
+        bench("PAGED:setValue 1/16 budget", pd, batch/16, "op", [&]() {
+            static int k = 0;
+            for (int i=0;i<batch/16;i++) g.setValue(rc[i*3], rc[i*3+1], rc[i*3+2], (ValueType)(1 + k++ % 2));
+        });
+        OctreePageStats st = g.getStorage().stats();
+        extra("writebacks/run", (double)st.writebacks / (results.back().runs + 1), "%10.1f %s\n");
+        if (st.loaded == st.pages || st.evictions == 0) {
+            fprintf(stderr, "paged world over budget: %zu bytes, %ld of %ld pages loaded\n", st.bytes, st.loaded, st.pages);
+            exit(1);
+        }
+        for (long i=0;i<st.pages;i++) {
+            sprintf(file, "%s.%ld", world, i);
+            remove(file);
+        }
+    }
+
+    // rays: a 256x256 pinhole camera looking at the center. Rays of
+    // neighbor pixels are adjacent, "shuffled" breaks the coherence.
+    const int res = 256;
+    vector<OctreeRay> rays;
+    float eye[3] = {-0.6f*voxel.size(), 0.3f*voxel.size(), 1.4f*voxel.size()};
+    for (int j=0;j<res;j++) {
+        for (int i=0;i<res;i++) {
+            float d[3];
+            for (int k=0;k<3;k++) d[k] = sz - eye[k];
+            d[0] += (i - res/2) * 0.004f * sz;
+            d[1] += (j - res/2) * 0.004f * sz;
+            float l = sqrt(d[0]*d[0] + d[1]*d[1] + d[2]*d[2]);
+            rays.push_back(OctreeRay(eye[0], eye[1], eye[2], d[0]/l, d[1]/l, d[2]/l));
+        }
+    }
+    vector<OctreeRayHit> hits(rays.size());
+    bench("RAY:single", depth, (double)rays.size(), "ray", [&]() {
+        for (size_t i=0;i<rays.size();i++) voxel.raycast(rays[i], hits[i]);
+    });
+    sprintf(name, "RAY:packet x%d", OCTREE_RAY_LANES);
+    bench(name, depth, (double)rays.size(), "ray", [&]() {
+        voxel.raycast(&rays[0], &hits[0], (long)rays.size());
+    });
+    srand(1);
+    for (size_t i=rays.size()-1;i>0;i--) swap(rays[i], rays[rand() % (i+1)]);
+    bench("RAY:packet shuffled", depth, (double)rays.size(), "ray", [&]() {
+        voxel.raycast(&rays[0], &hits[0], (long)rays.size());
+    });
+
+    if (json && !write_json(json, max_threads)) {
+        fprintf(stderr, "cannot write %s\n", json);
+        return 1;
+    }
+    return nsum == 0;
+}
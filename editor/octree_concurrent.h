@@ -0,0 +1,261 @@
+#ifndef _OCTREE_CONCURRENT_H
+#define _OCTREE_CONCURRENT_H
+
+#include <vector>
+#include <atomic>
+#include <algorithm>
+#include "octree_node.h"
+#include "octree_epoch.h"
+
+// Storage backend for Octree with one writer and concurrent readers.
+//
+// A published child block never changes but for a child pointer going
+// from NULL to a new block (split), which is stored atomically. Any other
+// change of a node (value, merge, collapse) copies the block of the node
+// and its siblings and swaps it in with one atomic store, so a reader
+// sees every node either before or after an edit, and always a complete
+// tree. Replaced blocks are freed by epoch based reclamation: readers
+// pin an epoch while they read and take no locks.
+//
+//   Octree<V, OctreeConcurrentStorage<V> > tree(depth);
+//   // reader thread
+//   OctreeEpochs::Reader r(tree.getStorage().epochs());
+//   { OctreeEpochs::Guard g(r); v = tree.getValue(x, y, z); }
+//
+// Readers may use anything of Octree that does not change it (getValue,
+// cursors, leaves, toDense, raycast...) under a guard. Only one thread
+// edits; it needs no guard. The orientation must not change while
+// readers run. setValue frees what was replaced now and then; call
+// reclaim() after other edits (sphere, combine, fromDense...).
+template <typename V>
+class OctreeConcurrentStorage {
+    struct Block;
+
+public:
+    struct ConcurrentNode {
+        V value;
+        std::atomic<Block*> child;
+    };
+
+    // Writers look the node up again through slot (the pointer to its
+    // block) and i, as its block may have been replaced meanwhile.
+    struct Node {
+        ConcurrentNode *p;
+        std::atomic<Block*> *slot;
+        int i;
+        Node() : p(NULL), slot(NULL), i(0) {}
+        Node(ConcurrentNode *n, std::atomic<Block*> *s, int c) : p(n), slot(s), i(c) {}
+    };
+
+private:
+    struct Block {
+        ConcurrentNode n[8];
+    };
+
+    struct Retired {
+        Block *b;
+        bool tree;  // with the blocks below
+    };
+
+    // the root is node 0 of its own block
+    mutable std::atomic<Block*> top;
+    mutable OctreeEpochs ep;
+    std::vector<Retired> retired[2];  // by epoch
+    size_t pending;                   // retired since the last reclaim()
+    long live;
+#if _OCTREE_STATS
+    OctreeEditStats edits;
+#endif
+
+    OctreeConcurrentStorage(const OctreeConcurrentStorage&);
+    OctreeConcurrentStorage& operator=(const OctreeConcurrentStorage&);
+
+    Block *alloc() {
+        live++;
+        return new Block();
+    }
+
+    void destroy(Block *b, bool tree) {
+        if (tree) {
+            for (int i=0;i<8;i++) {
+                Block *c = b->n[i].child.load(std::memory_order_relaxed);
+                if (c) destroy(c, true);
+            }
+        }
+        live--;
+        delete b;
+    }
+
+    void retire(Block *b, bool tree) {
+        Retired r = {b, tree};
+        retired[ep.epoch() & 1].push_back(r);
+        pending++;
+    }
+
+    void release(std::vector<Retired> &l) {
+        for (size_t i=0;i<l.size();i++) {
+            destroy(l[i].b, l[i].tree);
+        }
+        l.clear();
+    }
+
+    inline ConcurrentNode *node(Node n) const {
+        return n.slot->load(std::memory_order_relaxed)->n + n.i;
+    }
+
+    // Swaps in a copy of the block of n with n replaced by (v, c).
+    void replace(Node n, const V &v, Block *c) {
+        Block *old = n.slot->load(std::memory_order_relaxed);
+        Block *b = alloc();
+        for (int k=0;k<8;k++) {
+            b->n[k].value = old->n[k].value;
+            b->n[k].child.store(old->n[k].child.load(std::memory_order_relaxed), std::memory_order_relaxed);
+        }
+        b->n[n.i].value = v;
+        b->n[n.i].child.store(c, std::memory_order_relaxed);
+        n.slot->store(b, std::memory_order_release);
+        retire(old, false);
+    }
+
+    void setValue(Node n, long x, long y, long z, long d, const V &v) {
+        if (d == 0) {
+            collapse(n, v);
+            return;
+        }
+        ConcurrentNode *p = node(n);
+        if (!p->child.load(std::memory_order_relaxed)) {
+            if (p->value == v) return;
+            split(n);
+            OCTREE_STAT(edits.splits++);
+        }
+        int i=0;
+        if (x&DEPTH_MASK) {i|=1;}
+        if (y&DEPTH_MASK) {i|=2;}
+        if (z&DEPTH_MASK) {i|=4;}
+        setValue(mutableChild(n, i), x<<1, y<<1, z<<1, d-1, v);
+
+        // the child block is the one the edit swapped in
+        Block *b = p->child.load(std::memory_order_relaxed);
+        for (i=0;i<8;i++) {
+            if (b->n[i].child.load(std::memory_order_relaxed) != NULL || b->n[i].value != v) return;
+        }
+        collapse(n, v);
+        OCTREE_STAT(edits.merges++);
+    }
+
+public:
+    OctreeConcurrentStorage(V v = V()) : pending(0), live(0) {
+        Block *b = alloc();
+        for (int i=0;i<8;i++) {
+            b->n[i].value = v;
+            b->n[i].child.store(NULL, std::memory_order_relaxed);
+        }
+        top.store(b, std::memory_order_relaxed);
+    }
+    // No reader may be left.
+    ~OctreeConcurrentStorage() {
+        release(retired[0]);
+        release(retired[1]);
+        destroy(top.load(std::memory_order_relaxed), true);
+    }
+
+    // Readers register here (see OctreeEpochs::Reader).
+    OctreeEpochs& epochs() const {
+        return ep;
+    }
+
+    // Frees the blocks replaced before the epoch the slowest reader is
+    // pinned in. Without pinned readers, everything replaced so far.
+    void reclaim() {
+        pending = 0;
+        for (int k=0;k<2 && ep.advance();k++) {
+            release(retired[ep.epoch() & 1]);
+        }
+    }
+
+    // Blocks waiting for readers to move on.
+    size_t blocksRetired() const {
+        return retired[0].size() + retired[1].size();
+    }
+    long blocksLive() const {
+        return live;
+    }
+    size_t bytesReserved() const {
+        return live * sizeof(Block);
+    }
+
+#if _OCTREE_STATS
+    const OctreeEditStats& editStats() const {
+        return edits;
+    }
+#endif
+
+    inline Node root() const {
+        return Node(top.load(std::memory_order_acquire)->n, &top, 0);
+    }
+    inline bool hasChild(Node n) const {
+        return n.p->child.load(std::memory_order_acquire) != NULL;
+    }
+    inline const V& value(Node n) const {
+        return n.p->value;
+    }
+    inline Node child(Node n, int i) const {
+        return Node(n.p->child.load(std::memory_order_acquire)->n + i, &n.p->child, i);
+    }
+    inline Node mutableChild(Node n, int i) {
+        ConcurrentNode *p = node(n);
+        return Node(p->child.load(std::memory_order_relaxed)->n + i, &p->child, i);
+    }
+
+    void split(Node n) {
+        ConcurrentNode *p = node(n);
+        Block *b = alloc();
+        for (int i=0;i<8;i++) {
+            b->n[i].value = p->value;
+            b->n[i].child.store(NULL, std::memory_order_relaxed);
+        }
+        p->child.store(b, std::memory_order_release);
+    }
+    void collapse(Node n, V v) {
+        ConcurrentNode *p = node(n);
+        Block *c = p->child.load(std::memory_order_relaxed);
+        if (!c && p->value == v) return;
+        replace(n, v, NULL);
+        if (c) retire(c, true);
+    }
+    void swap(Node a, Node b) {
+        ConcurrentNode *pa = node(a), *pb = node(b);
+        V va = pa->value, vb = pb->value;
+        Block *ca = pa->child.load(std::memory_order_relaxed), *cb = pb->child.load(std::memory_order_relaxed);
+        replace(a, vb, cb);
+        replace(b, va, ca);
+    }
+
+    inline V getValue(long x,long y,long z, long depth) const {
+        const ConcurrentNode *n = top.load(std::memory_order_acquire)->n;
+        for (;depth>0;depth--) {
+            Block *b = n->child.load(std::memory_order_acquire);
+            if (!b) break;
+            int i=0;
+            if (x&DEPTH_MASK) {i|=1;}
+            if (y&DEPTH_MASK) {i|=2;}
+            if (z&DEPTH_MASK) {i|=4;}
+            n = b->n + i;
+            x<<=1; y<<=1; z<<=1;
+        }
+        return n->value;
+    }
+    // Tries to free the replaced blocks every 256 of them.
+    void setValue(long x,long y,long z, long depth, V v) {
+        OCTREE_STAT(edits.sets++);
+        setValue(root(), x, y, z, depth, v);
+        if (pending >= 256) reclaim();
+    }
+};
+
+template <typename V>
+inline size_t octree_storage_bytes(const OctreeConcurrentStorage<V> &s) {
+    return sizeof(s) + s.bytesReserved();
+}
+
+#endif
@@ -0,0 +1,111 @@
+#ifndef _OCTREE_CSG_H
+#define _OCTREE_CSG_H
+
+// Operations for Octree::combine, which walks two trees of the same depth
+// together and stores the result in the first one (self, a) from the
+// other one (b):
+//   V operator()(a, b): value of a cell.
+//   int self(a, v):  decision for a subtree of b where self is a.
+//   int other(b, v): decision for a subtree of self where b is b.
+// The decisions let whole subtrees be done in one step:
+enum {
+    OCTREE_CSG_WALK = 0,  // depends on the cells, go down
+    OCTREE_CSG_KEEP = 1,  // self does not change
+    OCTREE_CSG_FILL = 2,  // every cell gets v
+    OCTREE_CSG_TAKE = 3,  // the subtree of the other tree is copied
+};
+
+// Cells with a value other than V() in either tree; self wins.
+template <typename V>
+struct OctreeCsgUnion {
+    V operator()(const V &a, const V &b) const {
+        return a != V() ? a : b;
+    }
+    int self(const V &a, V &) const {
+        return a != V() ? OCTREE_CSG_KEEP : OCTREE_CSG_TAKE;
+    }
+    int other(const V &b, V &) const {
+        return b == V() ? OCTREE_CSG_KEEP : OCTREE_CSG_WALK;
+    }
+};
+
+// Cells of self that are also set in the other tree.
+template <typename V>
+struct OctreeCsgIntersect {
+    V operator()(const V &a, const V &b) const {
+        return b != V() ? a : V();
+    }
+    int self(const V &a, V &) const {
+        return a == V() ? OCTREE_CSG_KEEP : OCTREE_CSG_WALK;
+    }
+    int other(const V &b, V &v) const {
+        if (b != V()) return OCTREE_CSG_KEEP;
+        v = V();
+        return OCTREE_CSG_FILL;
+    }
+};
+
+// Cells of self that are not set in the other tree.
+template <typename V>
+struct OctreeCsgSubtract {
+    V operator()(const V &a, const V &b) const {
+        return b != V() ? V() : a;
+    }
+    int self(const V &a, V &) const {
+        return a == V() ? OCTREE_CSG_KEEP : OCTREE_CSG_WALK;
+    }
+    int other(const V &b, V &v) const {
+        if (b == V()) return OCTREE_CSG_KEEP;
+        v = V();
+        return OCTREE_CSG_FILL;
+    }
+};
+
+// The other tree over self, except its cells with the value mask.
+template <typename V>
+struct OctreeCsgPaste {
+    V mask;
+
+    OctreeCsgPaste(const V &m = V()) : mask(m) {}
+
+    V operator()(const V &a, const V &b) const {
+        return b != mask ? b : a;
+    }
+    int self(const V &, V &) const {
+        return OCTREE_CSG_WALK;
+    }
+    int other(const V &b, V &v) const {
+        if (b == mask) return OCTREE_CSG_KEEP;
+        v = b;
+        return OCTREE_CSG_FILL;
+    }
+};
+
+// Any V f(a, b), decided per cell: only pairs of leaves are done at once.
+template <typename V, typename F>
+struct OctreeCsgFunc {
+    const F &f;
+
+    OctreeCsgFunc(const F &fn) : f(fn) {}
+
+    V operator()(const V &a, const V &b) const {
+        return f(a, b);
+    }
+    int self(const V &, V &) const {
+        return OCTREE_CSG_WALK;
+    }
+    int other(const V &, V &) const {
+        return OCTREE_CSG_WALK;
+    }
+};
+
+
+// Makes node n of storage s the same subtree as node from of storage o
+// without copying, if the storages can share nodes. Storages that can
+// overload it (see OctreeSharedStorage); found at instantiation by ADL.
+template <typename S, typename S2>
+inline bool octree_share(S &, typename S::Node, const S2 &, typename S2::Node) {
+    return false;
+}
+
+#endif
@@ -0,0 +1,111 @@
+#ifndef _OCTREE_CURSOR_H
+#define _OCTREE_CURSOR_H
+
+#include "octree_node.h"
+#include "octree_orient.h"
+
+// Position in a tree: the leaf containing a cell and the path to it.
+//
+// A move goes up only to the common ancestor of the old and the new cell
+// (the highest bit in which their coordinates differ) and down from
+// there, so stepping to a face, edge or corner neighbor costs O(1)
+// amortized instead of a walk from the root. Moves within the same leaf
+// cost nothing.
+//
+// Works with any storage. Changing the tree invalidates the path; call
+// reset() (or take a new Octree::cursor()) after an edit.
+template <typename V, typename S>
+class OctreeCursor {
+    typedef typename S::Node Node;
+
+    const S *s;
+    OctreeOrientation o;
+    bool oriented;
+    int depth;
+    long size;
+    long l[3];  // cell in the coordinates of the tree
+    long c[3];  // same in the storage
+    int sp;
+    Node stack[MAX_DEPTH+1];
+
+    void descend() {
+        while (sp < depth && s->hasChild(stack[sp])) {
+            int b = depth-sp-1;
+            int i = (int)(((c[0] >> b) & 1) | (((c[1] >> b) & 1) << 1) | (((c[2] >> b) & 1) << 2));
+            stack[sp+1] = s->child(stack[sp], i);
+            sp++;
+        }
+    }
+
+public:
+    OctreeCursor(const S &st, int d, const OctreeOrientation &ot = OctreeOrientation()) :
+            s(&st), o(ot), oriented(!ot.identity()), depth(d), size(1L << d) {
+        reset();
+    }
+
+    // Back to cell (0,0,0) from the root.
+    void reset() {
+        l[0] = l[1] = l[2] = 0;
+        c[0] = c[1] = c[2] = 0;
+        o.apply(c[0], c[1], c[2], size);
+        sp = 0;
+        stack[0] = s->root();
+        descend();
+    }
+
+    // Moves to cell (x,y,z). Returns false (and stays) if it is outside.
+    bool move(long x, long y, long z) {
+        if (x<0 || x>=size || y<0 || y>=size || z<0 || z>=size) return false;
+        l[0] = x;
+        l[1] = y;
+        l[2] = z;
+        if (oriented) o.apply(x, y, z, size);
+        long diff = (x ^ c[0]) | (y ^ c[1]) | (z ^ c[2]);
+        c[0] = x;
+        c[1] = y;
+        c[2] = z;
+        int up = octree_bit_length(diff);
+        if (sp > depth - up) {
+            sp = depth - up;
+            descend();
+        }
+        return true;
+    }
+
+    // Moves to the neighbor (dx,dy,dz) of the cell, e.g. (1,0,0) for the
+    // face neighbor along +x, (1,1,1) for a corner.
+    bool step(int dx, int dy, int dz) {
+        return move(l[0]+dx, l[1]+dy, l[2]+dz);
+    }
+
+    // Value of cell (x,y,z) like Octree::getValue (-1 if outside). The
+    // cursor moves there.
+    V at(long x, long y, long z) {
+        return move(x, y, z) ? s->value(stack[sp]) : V(-1);
+    }
+
+    const V& value() const {
+        return s->value(stack[sp]);
+    }
+    Node node() const {
+        return stack[sp];
+    }
+    long x() const {
+        return l[0];
+    }
+    long y() const {
+        return l[1];
+    }
+    long z() const {
+        return l[2];
+    }
+    // Level of the leaf (0: root) and its size in cells.
+    int level() const {
+        return sp;
+    }
+    long leafSize() const {
+        return 1L << (depth-sp);
+    }
+};
+
+#endif
@@ -0,0 +1,170 @@
+#ifndef _OCTREE_DAG_H
+#define _OCTREE_DAG_H
+
+#include <vector>
+#include <functional>
+#include <unordered_map>
+#include <unordered_set>
+#include <stdint.h>
+#include "octree_node.h"
+
+// Size of a tree after identical subtrees were merged (hash-consing).
+// tree: nodes with children in the equivalent tree, nodes: distinct ones.
+struct OctreeDagStats {
+    uint64_t tree;
+    size_t nodes;
+    size_t bytes;
+
+    double ratio() const {
+        return nodes ? (double)tree / nodes : 1.0;
+    }
+};
+
+static const uint32_t OCTREE_DAG_LEAF = 0x80000000u;
+
+inline size_t octree_hash_mix(size_t h, size_t v) {
+    return h ^ (v + 0x9e3779b9 + (h << 6) + (h >> 2));
+}
+
+
+// Read-only storage backend for Octree: a sparse voxel DAG.
+//
+// Each distinct subtree is stored once. A node is 8 32-bit child
+// references; a reference with OCTREE_DAG_LEAF set is the index of a leaf
+// value, otherwise the index of a node. Uniform nodes are merged into
+// leaves. Build it from any other storage:
+//   Octree<V, OctreeDagStorage<V> > dag(depth, OctreeDagStorage<V>(tree.getStorage()));
+// getValue, get_slice and the other readers of Octree work on it, edits
+// do not.
+template <typename V>
+class OctreeDagStorage {
+public:
+    typedef uint32_t Node;
+
+private:
+    // node hash set over the childs array, keyed by node index
+    struct NodeHash {
+        const std::vector<uint32_t> *c;
+        size_t operator()(uint32_t n) const {
+            size_t h = 0;
+            for (int i=0;i<8;i++) h = octree_hash_mix(h, (*c)[n*8+i]);
+            return h;
+        }
+    };
+    struct NodeEq {
+        const std::vector<uint32_t> *c;
+        bool operator()(uint32_t a, uint32_t b) const {
+            for (int i=0;i<8;i++) {
+                if ((*c)[a*8+i] != (*c)[b*8+i]) return false;
+            }
+            return true;
+        }
+    };
+    typedef std::unordered_set<uint32_t, NodeHash, NodeEq> NodeSet;
+    typedef std::unordered_map<V, uint32_t> LeafMap;
+
+    std::vector<uint32_t> childs;
+    std::vector<V> values;
+    Node top;
+    V none;
+    OctreeDagStats st;
+
+    template<typename S>
+    uint32_t add(const S &s, typename S::Node n, NodeSet &set, LeafMap &leaves) {
+        if (!s.hasChild(n)) {
+            const V &v = s.value(n);
+            typename LeafMap::iterator it = leaves.find(v);
+            if (it != leaves.end()) return it->second;
+            uint32_t l = OCTREE_DAG_LEAF | (uint32_t)values.size();
+            values.push_back(v);
+            leaves[v] = l;
+            return l;
+        }
+        st.tree++;
+        uint32_t c[8];
+        bool uniform = true;
+        for (int i=0;i<8;i++) {
+            c[i] = add(s, s.child(n, i), set, leaves);
+            uniform &= c[i] == c[0];
+        }
+        if (uniform && (c[0] & OCTREE_DAG_LEAF)) return c[0];
+
+        uint32_t b = (uint32_t)(childs.size() / 8);
+        childs.insert(childs.end(), c, c+8);
+        std::pair<typename NodeSet::iterator, bool> r = set.insert(b);
+        if (!r.second) {
+            childs.resize((size_t)b*8);
+            return *r.first;
+        }
+        return b;
+    }
+
+public:
+    OctreeDagStorage(V v = V()) : values(1, v), top(OCTREE_DAG_LEAF), none() {
+        st.tree = 0;
+        st.nodes = 0;
+        st.bytes = sizeof(V);
+    }
+
+    template<typename S>
+    explicit OctreeDagStorage(const S &s) : none() {
+        build(s, s.root());
+    }
+
+    // Replaces the contents with the subtree n of s. s is walked as a
+    // tree: a block s shares is visited once per reference.
+    template<typename S>
+    OctreeDagStats build(const S &s, typename S::Node n) {
+        childs.clear();
+        values.clear();
+        st.tree = 0;
+        NodeHash h = {&childs};
+        NodeEq eq = {&childs};
+        NodeSet set(1024, h, eq);
+        LeafMap leaves;
+        top = add(s, n, set, leaves);
+        std::vector<uint32_t>(childs).swap(childs);
+        std::vector<V>(values).swap(values);
+        st.nodes = childs.size() / 8;
+        st.bytes = childs.size() * sizeof(uint32_t) + values.size() * sizeof(V);
+        return st;
+    }
+
+    const OctreeDagStats& stats() const {
+        return st;
+    }
+
+    inline Node root() const {
+        return top;
+    }
+    inline bool hasChild(Node n) const {
+        return !(n & OCTREE_DAG_LEAF);
+    }
+    // V() for nodes with children.
+    inline const V& value(Node n) const {
+        return (n & OCTREE_DAG_LEAF) ? values[n & ~OCTREE_DAG_LEAF] : none;
+    }
+    inline Node child(Node n, int i) const {
+        return childs[(size_t)n*8+i];
+    }
+
+    inline V getValue(long x,long y,long z, long depth) const {
+        Node n = top;
+        for (;depth>0 && !(n & OCTREE_DAG_LEAF);depth--) {
+            int i=0;
+            if (x&DEPTH_MASK) {i|=1;}
+            if (y&DEPTH_MASK) {i|=2;}
+            if (z&DEPTH_MASK) {i|=4;}
+            n = childs[(size_t)n*8+i];
+            x<<=1; y<<=1; z<<=1;
+        }
+        return value(n);
+    }
+};
+
+template <typename V>
+inline size_t octree_storage_bytes(const OctreeDagStorage<V> &s) {
+    return s.stats().bytes;
+}
+
+#endif
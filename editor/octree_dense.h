@@ -0,0 +1,162 @@
+#ifndef _OCTREE_DENSE_H
+#define _OCTREE_DENSE_H
+
+#include <vector>
+#include <cstddef>
+#include "octree_pool.h"
+
+// Dense cube of 1<<depth cells: cell (x,y,z) is data[x*st[0]+y*st[1]+z*st[2]]
+// (strides may be negative).
+//
+// classify() marks the mixed cubes of every level bottom up in one pass
+// over the cells, so a tree can be built top down allocating only the
+// nodes that stay. A uniform cube has the value of its first cell. Level
+// 1 is not kept (8 cells are compared again when needed): the flags take
+// 1/56 byte per cell.
+template <typename V>
+class OctreeDenseVolume {
+    const V *data;
+    long st[3];
+    int depth;
+    std::vector<std::vector<char> > mixed;  // [d][Morton index in level d], d>=2
+
+    bool same(long x, long y, long z, long size) const {
+        const V &v = at(x, y, z);
+        for (long k=0;k<size;k++) {
+            for (long j=0;j<size;j++) {
+                const V *p = data + x*st[0] + (y+j)*st[1] + (z+k)*st[2];
+                for (long i=0;i<size;i++) {
+                    if (p[i*st[0]] != v) return false;
+                }
+            }
+        }
+        return true;
+    }
+
+    // stop: level done before (by another task), 0 for none.
+    bool classify(long x, long y, long z, int d, size_t m, int stop) {
+        if (stop > 0 && d == stop) return !mixed[d][m];
+        bool u;
+        if (d <= 2) {
+            u = same(x, y, z, 1L<<d);
+        } else {
+            u = true;
+            long half = 1L << (d-1);
+            for (int i=0;i<8;i++) {
+                u &= classify(x+half*(i&1), y+half*((i>>1)&1), z+half*((i>>2)&1), d-1, m*8+i, stop);
+            }
+            if (u) {
+                const V &v = at(x, y, z);
+                for (int i=1;i<8 && u;i++) {
+                    u = at(x+half*(i&1), y+half*((i>>1)&1), z+half*((i>>2)&1)) == v;
+                }
+            }
+        }
+        if (d >= 2) mixed[d][m] = !u;
+        return u;
+    }
+
+public:
+    OctreeDenseVolume(const V *p, long sx, long sy, long sz, int d) : data(p), depth(d), mixed(d+1) {
+        st[0] = sx;
+        st[1] = sy;
+        st[2] = sz;
+        for (int l=2;l<=d;l++) {
+            mixed[l].resize((size_t)1 << 3*(d-l));
+        }
+    }
+
+    inline const V& at(long x, long y, long z) const {
+        return data[x*st[0] + y*st[1] + z*st[2]];
+    }
+
+    // The 64 cubes two levels below the top are done in parallel if a
+    // pool is given.
+    void classify(OctreeWorkerPool *pool = NULL) {
+        if (!pool || pool->size() == 1 || depth < 5) {
+            classify(0, 0, 0, depth, 0, 0);
+            return;
+        }
+        int d = depth-2;
+        long size = 1L << d;
+        pool->run(64, [&](int t, int) {
+            long x = 0, y = 0, z = 0;
+            for (int k=0;k<2;k++) {
+                int i = (t >> 3*(1-k)) & 7;
+                long s = size << (1-k);
+                x += s*(i&1);
+                y += s*((i>>1)&1);
+                z += s*((i>>2)&1);
+            }
+            classify(x, y, z, d, t, 0);
+        });
+        classify(0, 0, 0, depth, 0, d);
+    }
+
+    // Cube (x,y,z,1<<d) with Morton index m in its level. Needs classify().
+    bool uniform(long x, long y, long z, int d, size_t m) const {
+        if (d == 0) return true;
+        if (d == 1) return same(x, y, z, 2);
+        return !mixed[d][m];
+    }
+};
+
+
+// Whether threads of a pool may read a storage at the same time
+// (Octree::toDense). Storages overload it next to their class; found at
+// instantiation by ADL.
+template <typename S>
+inline bool octree_parallel_read(const S &) {
+    return true;
+}
+
+
+// Builds a tree of type T (Octree or GLOctree) from slices along z, e.g.
+// from a scanner or a generator that makes one slice at a time. Slices are
+// kept until a slab of `slab` of them is complete, then every slab cube
+// is built with T::fromDense, so the memory is size*size*slab cells.
+template <typename V, typename T>
+class OctreeSliceBuilder {
+    T &tree;
+    long size;
+    long slab;
+    long z;
+    std::vector<V> buf;
+    OctreeWorkerPool *pool;
+
+public:
+    // slab: a power of 2, at most the size of the tree.
+    OctreeSliceBuilder(T &t, long s = 32, OctreeWorkerPool *p = NULL) :
+            tree(t), size(t.size()), slab(s < t.size() ? s : t.size()), z(0), pool(p) {
+        buf.resize((size_t)(size*size*slab));
+    }
+
+    // Adds the next slice: cell (x,y) is slice[x*sx+y*sy] (sy 0: size).
+    // Returns false if all slices are in.
+    bool push(const V *slice, long sx = 1, long sy = 0) {
+        if (z >= size) return false;
+        if (sy == 0) sy = size;
+        V *p = &buf[(size_t)(size*size*(z%slab))];
+        for (long y=0;y<size;y++) {
+            for (long x=0;x<size;x++) {
+                p[x+y*size] = slice[x*sx+y*sy];
+            }
+        }
+        z++;
+        if (z%slab == 0) {
+            long z0 = z-slab;
+            for (long y=0;y<size;y+=slab) {
+                for (long x=0;x<size;x+=slab) {
+                    tree.fromDense(x, y, z0, slab, &buf[(size_t)(x+y*size)], 1, size, size*size, pool);
+                }
+            }
+        }
+        return true;
+    }
+
+    bool done() const {
+        return z >= size;
+    }
+};
+
+#endif
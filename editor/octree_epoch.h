@@ -0,0 +1,116 @@
+#ifndef _OCTREE_EPOCH_H
+#define _OCTREE_EPOCH_H
+
+#include <atomic>
+#include <thread>
+#include <stdint.h>
+
+// Epoch based reclamation for one writer and readers without locks.
+//
+// A reader pins the current epoch while it holds pointers into the
+// structure (Guard). The writer retires what it unlinks in the current
+// epoch and advances the epoch only when every pinned reader is in it.
+// A reader pinned in epoch e+1 or later started after everything retired
+// in epoch e was unlinked, so once the epoch is e+2 nothing retired in e
+// is reachable and it can be freed.
+class OctreeEpochs {
+public:
+    static const int MAX_READERS = 64;
+
+private:
+    // one cache line per reader
+    struct Slot {
+        std::atomic<uint64_t> epoch;  // pinned epoch, 0: none
+        std::atomic<bool> used;
+        char pad[64 - sizeof(std::atomic<uint64_t>) - sizeof(std::atomic<bool>)];
+    };
+
+    std::atomic<uint64_t> global;
+    Slot slots[MAX_READERS];
+
+    OctreeEpochs(const OctreeEpochs&);
+    OctreeEpochs& operator=(const OctreeEpochs&);
+
+public:
+    OctreeEpochs() : global(1) {
+        for (int i=0;i<MAX_READERS;i++) {
+            slots[i].epoch.store(0, std::memory_order_relaxed);
+            slots[i].used.store(false, std::memory_order_relaxed);
+        }
+    }
+
+    // Slot of a reader thread, kept for its lifetime. Waits while
+    // MAX_READERS readers exist. Used by one thread at a time.
+    class Reader {
+        OctreeEpochs &e;
+        Slot *slot;
+        int pins;
+
+        Reader(const Reader&);
+        Reader& operator=(const Reader&);
+
+    public:
+        explicit Reader(OctreeEpochs &ep) : e(ep), slot(NULL), pins(0) {
+            for (int i=0;;i=(i+1)%MAX_READERS) {
+                bool f = false;
+                if (e.slots[i].used.compare_exchange_strong(f, true, std::memory_order_acquire)) {
+                    slot = e.slots + i;
+                    break;
+                }
+                if (i == MAX_READERS-1) std::this_thread::yield();
+            }
+        }
+        ~Reader() {
+            slot->epoch.store(0, std::memory_order_release);
+            slot->used.store(false, std::memory_order_release);
+        }
+
+        // Pins can nest.
+        void pin() {
+            if (pins++) return;
+            slot->epoch.store(e.global.load(std::memory_order_seq_cst), std::memory_order_seq_cst);
+            // the pin is seen by the writer before any pointer is read
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+        }
+        void unpin() {
+            if (--pins) return;
+            slot->epoch.store(0, std::memory_order_release);
+        }
+    };
+
+    // Pointers read while the guard lives stay valid.
+    class Guard {
+        Reader &r;
+
+        Guard(const Guard&);
+        Guard& operator=(const Guard&);
+
+    public:
+        explicit Guard(Reader &rd) : r(rd) {
+            r.pin();
+        }
+        ~Guard() {
+            r.unpin();
+        }
+    };
+
+    uint64_t epoch() const {
+        return global.load(std::memory_order_relaxed);
+    }
+
+    // Writer: advances the epoch if every pinned reader is in the current
+    // one. Everything unlinked before is then seen as unlinked by readers
+    // pinned later.
+    bool advance() {
+        uint64_t g = global.load(std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        for (int i=0;i<MAX_READERS;i++) {
+            uint64_t p = slots[i].epoch.load(std::memory_order_acquire);
+            if (p != 0 && p != g) return false;
+        }
+        global.store(g+1, std::memory_order_seq_cst);
+        return true;
+    }
+};
+
+#endif
@@ -0,0 +1,120 @@
+#ifndef _OCTREE_FILL_H
+#define _OCTREE_FILL_H
+
+#include <cstddef>
+#include <cstring>
+#include <algorithm>
+#include <type_traits>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define _OCTREE_FILL_SSE2 1
+#else
+#define _OCTREE_FILL_SSE2 0
+#endif
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define _OCTREE_FILL_AVX2 1
+#else
+#define _OCTREE_FILL_AVX2 0
+#endif
+
+
+// Fills homogeneous runs of values. 4 and 8 byte values are written with
+// 32 byte stores with AVX2, 16 byte stores with SSE2.
+template <typename V, size_t SIZE>
+struct OctreeFill {
+    static inline void fill(V *p, size_t n, const V &v) {
+        std::fill(p, p+n, v);
+    }
+};
+
+#if _OCTREE_FILL_SSE2
+template <typename V>
+struct OctreeFill<V, 4> {
+    static inline void fill(V *p, size_t n, const V &v) {
+        size_t i=0, m=n&~(size_t)7;
+        if (m) {
+            int bits;
+            memcpy(&bits, &v, 4);
+#if _OCTREE_FILL_AVX2
+            __m256i y = _mm256_set1_epi32(bits);
+            for (size_t m2=n&~(size_t)15;i<m2;i+=16) {
+                _mm256_storeu_si256(reinterpret_cast<__m256i*>(p+i), y);
+                _mm256_storeu_si256(reinterpret_cast<__m256i*>(p+i+8), y);
+            }
+#endif
+            __m128i w = _mm_set1_epi32(bits);
+            for (;i<m;i+=8) {
+                _mm_storeu_si128(reinterpret_cast<__m128i*>(p+i), w);
+                _mm_storeu_si128(reinterpret_cast<__m128i*>(p+i+4), w);
+            }
+        }
+        for (;i<n;i++) p[i] = v;
+    }
+};
+
+template <typename V>
+struct OctreeFill<V, 8> {
+    static inline void fill(V *p, size_t n, const V &v) {
+        size_t i=0, m=n&~(size_t)3;
+        if (m) {
+            __m128i w = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(&v));
+            w = _mm_unpacklo_epi64(w, w);
+#if _OCTREE_FILL_AVX2
+            __m256i y = _mm256_broadcastsi128_si256(w);
+            for (size_t m2=n&~(size_t)7;i<m2;i+=8) {
+                _mm256_storeu_si256(reinterpret_cast<__m256i*>(p+i), y);
+                _mm256_storeu_si256(reinterpret_cast<__m256i*>(p+i+4), y);
+            }
+#endif
+            for (;i<m;i+=4) {
+                _mm_storeu_si128(reinterpret_cast<__m128i*>(p+i), w);
+                _mm_storeu_si128(reinterpret_cast<__m128i*>(p+i+2), w);
+            }
+        }
+        for (;i<n;i++) p[i] = v;
+    }
+};
+#endif
+
+template <typename V>
+inline void octree_fill(V *p, size_t n, const V &v) {
+    OctreeFill<V, std::is_trivially_copyable<V>::value ? sizeof(V) : 0>::fill(p, n, v);
+}
+
+// w*h cells, rows are `stride` apart.
+template <typename V>
+inline void octree_fill(V *p, int w, int h, int stride, const V &v) {
+    if (w <= 0) return;
+    if (w == 1) {
+        for (int j=0;j<h;j++) p[j*stride] = v;
+        return;
+    }
+    for (int j=0;j<h;j++) {
+        octree_fill(p + j*stride, (size_t)w, v);
+    }
+}
+
+// w*h*d cells with the strides sx, sy, sz. Runs along an axis with
+// stride 1 use the vector stores above.
+template <typename V>
+inline void octree_fill(V *p, long w, long h, long d, long sx, long sy, long sz, const V &v) {
+    long n[3] = {w, h, d}, s[3] = {sx, sy, sz};
+    int a = s[0] == 1 ? 0 : s[1] == 1 ? 1 : s[2] == 1 ? 2 : 0;
+    int b = (a+1)%3, c = (a+2)%3;
+    if (n[a] <= 0) return;
+    for (long k=0;k<n[c];k++) {
+        for (long j=0;j<n[b];j++) {
+            V *q = p + k*s[c] + j*s[b];
+            if (s[a] == 1) {
+                octree_fill(q, (size_t)n[a], v);
+            } else {
+                for (long i=0;i<n[a];i++) q[i*s[a]] = v;
+            }
+        }
+    }
+}
+
+#endif
@@ -0,0 +1,153 @@
+#ifndef _OCTREE_ITER_H
+#define _OCTREE_ITER_H
+
+#include <cstddef>
+#include <iterator>
+#include "octree_node.h"
+#include "octree_orient.h"
+#include "octree_region.h"
+
+// Homogeneous cube of cells (x,y,z,size) of a tree.
+template <typename V>
+struct OctreeLeaf {
+    long x, y, z;
+    long size;
+    V value;
+};
+
+
+// Forward iterator over the leaves of a tree in depth first order,
+// without recursion (the path is kept on a stack). Leaves outside box
+// are pruned with their subtrees; leaves with the value skip are left
+// out if skipping is on. Changing the tree invalidates it.
+template <typename V, typename S>
+class OctreeLeafIterator {
+    typedef typename S::Node Node;
+
+    struct Frame {
+        Node n;
+        long x, y, z;
+        int next;
+    };
+
+    const S *s;
+    OctreeOrientation o;
+    OctreeBox box;
+    bool skip;
+    V skip_value;
+    int depth;
+    int sp;
+    Frame stack[MAX_DEPTH+1];
+    OctreeLeaf<V> leaf;
+
+    void advance() {
+        while (sp >= 0) {
+            Frame &f = stack[sp];
+            if (f.next == 8) {
+                sp--;
+                continue;
+            }
+            int i = f.next++;
+            long half = 1L << (depth-sp-1);
+            long x = f.x+half*(i&1), y = f.y+half*((i>>1)&1), z = f.z+half*((i>>2)&1);
+            if (!box.intersects(x, y, z, half)) continue;
+            Node c = s->child(f.n, o.child[i]);
+            if (s->hasChild(c)) {
+                Frame &g = stack[++sp];
+                g.n = c;
+                g.x = x;
+                g.y = y;
+                g.z = z;
+                g.next = 0;
+                continue;
+            }
+            if (skip && s->value(c) == skip_value) continue;
+            leaf.x = x;
+            leaf.y = y;
+            leaf.z = z;
+            leaf.size = half;
+            leaf.value = s->value(c);
+            return;
+        }
+    }
+
+public:
+    typedef std::forward_iterator_tag iterator_category;
+    typedef OctreeLeaf<V> value_type;
+    typedef std::ptrdiff_t difference_type;
+    typedef const OctreeLeaf<V>* pointer;
+    typedef const OctreeLeaf<V>& reference;
+
+    // end
+    OctreeLeafIterator() : s(NULL), skip(false), skip_value(), depth(0), sp(-1) {}
+
+    OctreeLeafIterator(const S &st, int d, const OctreeOrientation &ot, const OctreeBox &b, bool sk, const V &sv) :
+            s(&st), o(ot), box(b), skip(sk), skip_value(sv), depth(d), sp(-1) {
+        Node root = s->root();
+        long size = 1L << d;
+        if (!box.intersects(0, 0, 0, size)) return;
+        sp = 0;
+        stack[0].n = root;
+        stack[0].x = stack[0].y = stack[0].z = 0;
+        if (s->hasChild(root)) {
+            stack[0].next = 0;
+            advance();
+            return;
+        }
+        // the root is the only leaf
+        stack[0].next = 8;
+        leaf.x = leaf.y = leaf.z = 0;
+        leaf.size = size;
+        leaf.value = s->value(root);
+        if (skip && leaf.value == skip_value) sp = -1;
+    }
+
+    reference operator*() const {
+        return leaf;
+    }
+    pointer operator->() const {
+        return &leaf;
+    }
+
+    OctreeLeafIterator& operator++() {
+        advance();
+        return *this;
+    }
+    OctreeLeafIterator operator++(int) {
+        OctreeLeafIterator i = *this;
+        advance();
+        return i;
+    }
+
+    // Iterators over the same tree are equal at the same leaf.
+    bool operator==(const OctreeLeafIterator &i) const {
+        if (sp < 0 || i.sp < 0) return sp < 0 && i.sp < 0;
+        return leaf.x == i.leaf.x && leaf.y == i.leaf.y && leaf.z == i.leaf.z && leaf.size == i.leaf.size;
+    }
+    bool operator!=(const OctreeLeafIterator &i) const {
+        return !(*this == i);
+    }
+};
+
+
+// begin()/end() pair for range-for, from Octree::leaves().
+template <typename V, typename S>
+class OctreeLeafRange {
+    OctreeLeafIterator<V, S> first;
+
+public:
+    typedef OctreeLeafIterator<V, S> iterator;
+    typedef OctreeLeafIterator<V, S> const_iterator;
+
+    OctreeLeafRange(const S &s, int depth, const OctreeOrientation &o, const OctreeBox &box, bool skip, const V &skip_value) :
+            first(s, depth, o, box, skip, skip_value) {}
+
+    iterator begin() const {
+        return first;
+    }
+    iterator end() const {
+        return iterator();
+    }
+};
+
+#endif
@@ -0,0 +1,183 @@
+#ifndef _OCTREE_LINEAR_H
+#define _OCTREE_LINEAR_H
+
+#include <vector>
+#include <stdint.h>
+#include "octree_node.h"
+
+// Storage backend for Octree: nodes in one contiguous array.
+//
+// Node 0 is the root. Children are allocated as blocks of 8 adjacent
+// nodes and referenced by the 32-bit index of the first one (0: leaf).
+// Values and child indices are kept in separate arrays, so a node costs
+// sizeof(V)+4 bytes without padding.
+template <typename V>
+class OctreeLinearStorage {
+public:
+    typedef uint32_t Node;
+
+private:
+    std::vector<uint32_t> childs;
+    std::vector<V> values;
+    std::vector<uint32_t> free_blocks;
+#if _OCTREE_STATS
+    OctreeEditStats edits;
+#endif
+
+    void freeBlock(uint32_t b) {
+        for (int i=0;i<8;i++) {
+            if (childs[b+i]) freeBlock(childs[b+i]);
+            childs[b+i] = 0;
+        }
+        free_blocks.push_back(b);
+    }
+
+public:
+    OctreeLinearStorage(V v = V()) : childs(1, 0), values(1, v) {}
+
+    inline Node root() const {
+        return 0;
+    }
+    inline bool hasChild(Node n) const {
+        return childs[n] != 0;
+    }
+    inline const V& value(Node n) const {
+        return values[n];
+    }
+    inline Node child(Node n, int i) const {
+        return childs[n] + i;
+    }
+    inline Node mutableChild(Node n, int i) {
+        return childs[n] + i;
+    }
+
+    void split(Node n) {
+        uint32_t b;
+        if (free_blocks.empty()) {
+            b = (uint32_t)childs.size();
+            childs.resize(b+8, 0);
+            values.resize(b+8, values[n]);
+        } else {
+            b = free_blocks.back();
+            free_blocks.pop_back();
+            for (int i=0;i<8;i++) {
+                values[b+i] = values[n];
+            }
+        }
+        childs[n] = b;
+    }
+    void collapse(Node n, V v) {
+        if (childs[n]) {
+            freeBlock(childs[n]);
+            childs[n] = 0;
+        }
+        values[n] = v;
+    }
+    void swap(Node a, Node b) {
+        std::swap(values[a], values[b]);
+        std::swap(childs[a], childs[b]);
+    }
+
+    inline V getValue(long x,long y,long z, long depth) const {
+        uint32_t n = 0;
+        for (;depth>0 && childs[n];depth--) {
+            int i=0;
+            if (x&DEPTH_MASK) {i|=1;}
+            if (y&DEPTH_MASK) {i|=2;}
+            if (z&DEPTH_MASK) {i|=4;}
+            n = childs[n] + i;
+            x<<=1; y<<=1; z<<=1;
+        }
+        return values[n];
+    }
+
+    void setValue(long x,long y,long z, long depth, V v) {
+        uint32_t path[MAX_DEPTH];
+        int d = 0;
+        uint32_t n = 0;
+        OCTREE_STAT(edits.sets++);
+        for (;d<depth;d++) {
+            if (childs[n] == 0) {
+                if (values[n] == v) return;
+                split(n);
+                OCTREE_STAT(edits.splits++);
+            }
+            int i=0;
+            if (x&DEPTH_MASK) {i|=1;}
+            if (y&DEPTH_MASK) {i|=2;}
+            if (z&DEPTH_MASK) {i|=4;}
+            path[d] = n;
+            n = childs[n] + i;
+            x<<=1; y<<=1; z<<=1;
+        }
+        values[n] = v;
+
+        // merge
+        while (d-- > 0) {
+            n = path[d];
+            uint32_t b = childs[n];
+            for (int i=0;i<8;i++) {
+                if (childs[b+i] || values[b+i] != v) return;
+            }
+            free_blocks.push_back(b);
+            childs[n] = 0;
+            values[n] = v;
+            OCTREE_STAT(edits.merges++);
+        }
+    }
+
+    // Rewrites the array in breadth-first order and drops free blocks.
+    void compact() {
+        std::vector<uint32_t> nc(1, 0);
+        std::vector<V> nv(1, values[0]);
+        std::vector<uint32_t> src(1, 0);
+        nc.reserve(childs.size() - free_blocks.size() * 8);
+        nv.reserve(nc.capacity());
+        src.reserve(nc.capacity());
+        for (size_t p=0;p<src.size();p++) {
+            uint32_t b = childs[src[p]];
+            if (b == 0) continue;
+            nc[p] = (uint32_t)nc.size();
+            for (int i=0;i<8;i++) {
+                nc.push_back(0);
+                nv.push_back(values[b+i]);
+                src.push_back(b+i);
+            }
+        }
+        childs.swap(nc);
+        values.swap(nv);
+        free_blocks.clear();
+    }
+
+    // child block of child i of n (values and indices) to the cache
+    inline void prefetch(Node n, int i) const {
+        uint32_t b = childs[childs[n] + i];
+        if (!b) return;
+        OCTREE_PREFETCH(&childs[b]);
+        OCTREE_PREFETCH(&values[b]);
+    }
+
+    long blocksLive() const { return (long)(childs.size() / 8 - free_blocks.size()); }
+    long blocksFree() const { return (long)free_blocks.size(); }
+    size_t bytesReserved() const {
+        return childs.capacity() * sizeof(uint32_t) + values.capacity() * sizeof(V);
+    }
+
+#if _OCTREE_STATS
+    const OctreeEditStats& editStats() const {
+        return edits;
+    }
+#endif
+};
+
+template <typename V>
+inline size_t octree_storage_bytes(const OctreeLinearStorage<V> &s) {
+    return s.bytesReserved();
+}
+
+template <typename V>
+inline void octree_prefetch(const OctreeLinearStorage<V> &s, uint32_t n, int i) {
+    s.prefetch(n, i);
+}
+
+#endif
@@ -1,37 +1,92 @@
 #ifndef _OCTREE_NODE_H
 #define _OCTREE_NODE_H
 
+#include <vector>
+#include <algorithm>
+#include "octree_allocator.h"
+#include "octree_stats.h"
+#include "octree_batch.h"
+
+// 1: nodes keep a pointer to their parent (+8 bytes per node on 64 bit).
+#ifndef _OCTREE_NODE_PARENT_REF
 #define _OCTREE_NODE_PARENT_REF 0
+#endif
 
 static const int MAX_DEPTH = 32;
-static const long DEPTH_MASK = 1 << (MAX_DEPTH - 1);
+static const long DEPTH_MASK = (long)(1UL << (MAX_DEPTH - 1));
+
+// Number of bits up to the highest set bit of v (0 for 0).
+inline int octree_bit_length(unsigned long v) {
+#if defined(__GNUC__)
+    return v ? (int)sizeof(v)*8 - __builtin_clzl(v) : 0;
+#else
+    int n = 0;
+    for (;v;v>>=1) n++;
+    return n;
+#endif
+}
 
 
 // Octree
 template <typename VTYPE>
 class OctreeNode {
 public:
+    typedef VTYPE ValueType;
+    typedef OctreeHeapAllocator<OctreeNode> DefaultAllocator;
+
     VTYPE value;
     OctreeNode *child;
 #if _OCTREE_NODE_PARENT_REF != 0
     OctreeNode *parent;
 #endif
 
+#if _OCTREE_NODE_PARENT_REF != 0
+    OctreeNode(VTYPE v) :  value(v), child(NULL), parent(NULL){}
+    OctreeNode() : child(NULL), parent(NULL) {}
+#else
     OctreeNode(VTYPE v) :  value(v), child(NULL){}
     OctreeNode() : child(NULL) {}
+#endif
     ~OctreeNode() {
         if (child) delete [] child;
     }
 
-    void makeChildNodes(){
-        child = new OctreeNode[8];
+    template<typename A>
+    void makeChildNodes(A &alloc){
+        child = alloc.allocBlock();
         for (int i=0;i<8;i++) {
             child[i].value = value;
 #if _OCTREE_NODE_PARENT_REF != 0
-            parent = this;
+            child[i].parent = this;
 #endif
         }
     }
+
+    // Points the parent of the children at this node again after the
+    // child block moved to it.
+    void linkChildNodes(){
+#if _OCTREE_NODE_PARENT_REF != 0
+        if (child == NULL) return;
+        for (int i=0;i<8;i++) {
+            child[i].parent = this;
+        }
+#endif
+    }
+
+    void makeChildNodes(){
+        DefaultAllocator alloc;
+        makeChildNodes(alloc);
+    }
+
+    template<typename A>
+    void freeChildNodes(A &alloc){
+        if (child == NULL) return;
+        for (int i=0;i<8;i++) {
+            child[i].freeChildNodes(alloc);
+        }
+        alloc.freeBlock(child);
+        child = NULL;
+    }
     
     inline const VTYPE& getValue() const {
         return value;
@@ -62,14 +117,15 @@ public:
         return child[i].getNode(x<<1, y<<1, z<<1, depth-1);
     }
 
-    void setValue(long x,long y,long z, long depth, VTYPE v){
+    template<typename A>
+    void setValue(long x,long y,long z, long depth, VTYPE v, A &alloc){
         if (depth == 0) {
             value = v;
             return;
         }
         if (child == NULL) {
             if (value == v) return;
-            makeChildNodes();
+            makeChildNodes(alloc);
         }
 
         int i=0;
@@ -77,16 +133,21 @@ public:
         if (y&DEPTH_MASK) {i|=2;}
         if (z&DEPTH_MASK) {i|=4;}
 
-        child[i].setValue(x<<1, y<<1, z<<1, depth-1, v);
+        child[i].setValue(x<<1, y<<1, z<<1, depth-1, v, alloc);
 
         for (i=0;i<8;i++) {
             if (child[i].child!=NULL || child[i].value != v) return;
         }
-        delete [] child;
+        alloc.freeBlock(child);
         child = NULL;
         value = v;
         //Log.d("Octree","marge! "+x+","+y+","+z+" v:"+v+" s:"+size);
     }
+
+    void setValue(long x,long y,long z, long depth, VTYPE v){
+        DefaultAllocator alloc;
+        setValue(x, y, z, depth, v, alloc);
+    }
     
 
     void serialize(std::vector<char> &buf) const {
@@ -100,20 +161,25 @@ public:
             }
         }
     }
-    void unserialize(const std::vector<char> &buf,int &p) {
-        delete [] child;
-        child = NULL;
+    template<typename A>
+    void unserialize(const std::vector<char> &buf,int &p, A &alloc) {
+        freeChildNodes(alloc);
         if (buf[p]==0) {
             p++;
             value=buf[p++];
         } else {
             p++;
-            makeChildNodes();
+            makeChildNodes(alloc);
             for (int i=0;i<8;i++) {
-                child[i].unserialize(buf,p);
+                child[i].unserialize(buf,p,alloc);
             }
         }
     }
+
+    void unserialize(const std::vector<char> &buf,int &p) {
+        DefaultAllocator alloc;
+        unserialize(buf, p, alloc);
+    }
     
     void rotate_z(){
     	if (child==NULL) return;
@@ -127,10 +193,119 @@ public:
 		}
 
         for (int i=0;i<8;i++) {
+#if _OCTREE_NODE_PARENT_REF != 0
+            child[i].parent = this;
+#endif
+            child[i].linkChildNodes();
             child[i].rotate_z();
         }
     }
 
 };
 
+
+// Storage backend for Octree: pointer linked OctreeNode.
+template <typename V, typename A = OctreeHeapAllocator<OctreeNode<V> > >
+class OctreeNodeStorage {
+public:
+    typedef OctreeNode<V>* Node;
+
+    OctreeNode<V> element;
+    A allocator;
+#if _OCTREE_STATS
+    OctreeEditStats edits;
+
+    // allocator of setValue: blocks made are splits, blocks freed merges.
+    struct CountingAllocator {
+        A &a;
+        OctreeEditStats &st;
+        OctreeNode<V>* allocBlock() {
+            st.splits++;
+            return a.allocBlock();
+        }
+        void freeBlock(OctreeNode<V>* b) {
+            st.merges++;
+            a.freeBlock(b);
+        }
+    };
+#endif
+
+    OctreeNodeStorage(V v = V()) {
+        element.value = v;
+    }
+    ~OctreeNodeStorage() {
+        allocator.releaseTree(element);
+    }
+
+    const A& getAllocator() const {
+        return allocator;
+    }
+#if _OCTREE_STATS
+    const OctreeEditStats& editStats() const {
+        return edits;
+    }
+#endif
+
+    inline Node root() const {
+        return const_cast<Node>(&element);
+    }
+    inline bool hasChild(Node n) const {
+        return n->child != NULL;
+    }
+    inline const V& value(Node n) const {
+        return n->value;
+    }
+    inline Node child(Node n, int i) const {
+        return n->child + i;
+    }
+#if _OCTREE_NODE_PARENT_REF != 0
+    // NULL for the root.
+    inline Node parent(Node n) const {
+        return n->parent;
+    }
+#endif
+    // child() for a change of the node (see OctreeSharedStorage).
+    inline Node mutableChild(Node n, int i) {
+        return n->child + i;
+    }
+
+    void split(Node n) {
+        n->makeChildNodes(allocator);
+    }
+    void collapse(Node n, V v) {
+        n->freeChildNodes(allocator);
+        n->value = v;
+    }
+    void swap(Node a, Node b) {
+        std::swap(a->value, b->value);
+        std::swap(a->child, b->child);
+        a->linkChildNodes();
+        b->linkChildNodes();
+    }
+
+    inline V getValue(long x,long y,long z, long depth) const {
+        return element.getValue(x, y, z, depth);
+    }
+    void setValue(long x,long y,long z, long depth, V v) {
+#if _OCTREE_STATS
+        edits.sets++;
+        CountingAllocator alloc = {allocator, edits};
+        element.setValue(x, y, z, depth, v, alloc);
+#else
+        element.setValue(x, y, z, depth, v, allocator);
+#endif
+    }
+};
+
+template <typename V, typename A>
+inline size_t octree_storage_bytes(const OctreeNodeStorage<V, A> &s) {
+    return sizeof(s) + s.getAllocator().bytesReserved();
+}
+
+template <typename V, typename A>
+inline void octree_prefetch(const OctreeNodeStorage<V, A> &, OctreeNode<V> *n, int i) {
+    OctreeNode<V> *c = n->child[i].child;
+    if (c) OCTREE_PREFETCH(c);
+}
+
 #endif
@@ -0,0 +1,113 @@
+#ifndef _OCTREE_ORIENT_H
+#define _OCTREE_ORIENT_H
+
+// Element of the symmetry group of the cube: the 48 combinations of the
+// 90 degree rotations and the mirrors along the axes.
+//
+// Maps the coordinates of a tree to those of its storage:
+//   stored[axis[i]] = (flip & (1<<i)) ? size-1-p[i] : p[i]
+// The same map applies to the child index at every level, so a lookup
+// costs one table access (child[i] is the stored index of child i).
+struct OctreeOrientation {
+    unsigned char axis[3];
+    unsigned char flip;
+    unsigned char child[8];
+
+    OctreeOrientation() : flip(0) {
+        for (int i=0;i<3;i++) axis[i] = (unsigned char)i;
+        update();
+    }
+
+    void update() {
+        for (int c=0;c<8;c++) {
+            int s = 0;
+            for (int i=0;i<3;i++) {
+                if (((c ^ flip) >> i) & 1) s |= 1 << axis[i];
+            }
+            child[c] = (unsigned char)s;
+        }
+    }
+
+    bool identity() const {
+        return flip == 0 && axis[0] == 0 && axis[1] == 1 && axis[2] == 2;
+    }
+
+    bool operator==(const OctreeOrientation &o) const {
+        return flip == o.flip && axis[0] == o.axis[0] && axis[1] == o.axis[1] && axis[2] == o.axis[2];
+    }
+    bool operator!=(const OctreeOrientation &o) const {
+        return !(*this == o);
+    }
+
+    // Map of m, then this.
+    OctreeOrientation operator*(const OctreeOrientation &m) const {
+        OctreeOrientation r;
+        r.flip = 0;
+        for (int i=0;i<3;i++) {
+            r.axis[i] = axis[m.axis[i]];
+            if (((flip >> m.axis[i]) ^ (m.flip >> i)) & 1) r.flip |= 1 << i;
+        }
+        r.update();
+        return r;
+    }
+
+    // Quarter turns around `axis` (0:x 1:y 2:z), as Octree::rotate_z: the
+    // new cell (x,y) is the old (size-1-y,x). Negative turns go back.
+    static OctreeOrientation rotation(int a, int turns = 1) {
+        int u = (a+1)%3, v = (a+2)%3;
+        OctreeOrientation q;
+        q.axis[u] = (unsigned char)v;
+        q.axis[v] = (unsigned char)u;
+        q.flip = (unsigned char)(1 << v);
+        q.update();
+        OctreeOrientation r;
+        for (turns &= 3;turns>0;turns--) r = r * q;
+        return r;
+    }
+
+    static OctreeOrientation mirror(int a) {
+        OctreeOrientation r;
+        r.flip = (unsigned char)(1 << a);
+        r.update();
+        return r;
+    }
+
+    inline void apply(long &x, long &y, long &z, long size) const {
+        long p[3] = {x, y, z}, s[3];
+        for (int i=0;i<3;i++) {
+            s[axis[i]] = (flip & (1<<i)) ? size-1-p[i] : p[i];
+        }
+        x = s[0];
+        y = s[1];
+        z = s[2];
+    }
+};
+
+
+// Read-only view of storage s with its children ordered by an
+// orientation, e.g. to pass an oriented tree to voxf_write.
+template <typename V, typename S>
+class OctreeOrientedStorage {
+    const S &s;
+    const OctreeOrientation &o;
+
+public:
+    typedef typename S::Node Node;
+
+    OctreeOrientedStorage(const S &st, const OctreeOrientation &ot) : s(st), o(ot) {}
+
+    inline Node root() const {
+        return s.root();
+    }
+    inline bool hasChild(Node n) const {
+        return s.hasChild(n);
+    }
+    inline const V& value(Node n) const {
+        return s.value(n);
+    }
+    inline Node child(Node n, int i) const {
+        return s.child(n, o.child[i]);
+    }
+};
+
+#endif
@@ -0,0 +1,446 @@
+#ifndef _OCTREE_PAGED_H
+#define _OCTREE_PAGED_H
+
+#include <map>
+#include <list>
+#include <string>
+#include <vector>
+#include <cstdio>
+#include "octree_node.h"
+#include "octree_voxf.h"
+
+// Counters of OctreePagedStorage.
+struct OctreePageStats {
+    long hits;        // page root entered while loaded
+    long misses;      // page loaded from its file
+    long evictions;   // page dropped from memory
+    long writebacks;  // dirty page written to its file
+    long errors;      // page files that could not be read or written
+    long pages;       // pages, loaded or not
+    long loaded;
+    size_t bytes;     // nodes of the loaded pages
+    size_t budget;
+};
+
+
+// Storage backend for Octree with subtrees paged out to files.
+//
+// Nodes at page_level (counted from the root) with children are pages.
+// A world is a VOXF file for the levels above (page roots are written as
+// VOXF_NODE_REF) and one VOXF file per page, named in externalRefs.
+// Pages are read on first access through child() and the least recently
+// used ones are dropped once the loaded pages exceed the memory budget,
+// checked when a page is read or grows (split). Dirty pages are written
+// back first.
+//
+// Pages are only dropped while another page is read or edited, and no
+// Octree operation holds nodes of a page after it moved on to the next
+// one, as they all walk depth first. saveVoxf/loadVoxf walk breadth first: use
+// open/flush instead. Not thread safe, also for readers.
+template <typename V>
+class OctreePagedStorage {
+    typedef OctreeNode<V> RawNode;
+
+    struct Page {
+        RawNode *node;
+        std::string file;  // relative to the world file
+        bool loaded;
+        bool dirty;
+        size_t bytes;      // nodes in memory, kept by split and collapse
+        typename std::list<Page*>::iterator lru;
+    };
+
+public:
+    struct Node {
+        RawNode *p;
+        Page *page;  // page below page_level, otherwise NULL
+        int level;
+        Node() : p(NULL), page(NULL), level(0) {}
+        Node(RawNode *n, Page *pg, int l) : p(n), page(pg), level(l) {}
+    };
+
+private:
+    OctreeNodeStorage<V> mem;
+    std::map<RawNode*, Page*> pages;  // by page root
+    std::list<Page*> lru;             // loaded pages, most recent first
+    std::string path, dir, base;
+    int depth;
+    int page_level;                   // 0: not paged
+    long next_id;
+    size_t budget;
+    OctreePageStats st;
+#if _OCTREE_STATS
+    OctreeEditStats edits;
+#endif
+
+    OctreePagedStorage(const OctreePagedStorage&);
+    OctreePagedStorage& operator=(const OctreePagedStorage&);
+
+    Page *find(RawNode *n) const {
+        typename std::map<RawNode*, Page*>::const_iterator it = pages.find(n);
+        return it == pages.end() ? NULL : it->second;
+    }
+
+    static size_t count(const RawNode *n) {
+        if (!n->child) return 0;
+        size_t b = sizeof(RawNode) * 8;
+        for (int i=0;i<8;i++) b += count(n->child + i);
+        return b;
+    }
+
+    Page *addPage(RawNode *n, const std::string &file, bool loaded) {
+        Page *pg = new Page();
+        pg->node = n;
+        pg->file = file;
+        pg->loaded = loaded;
+        pg->dirty = loaded;
+        pg->bytes = 0;
+        if (loaded) pg->lru = lru.insert(lru.begin(), pg);
+        pages[n] = pg;
+        return pg;
+    }
+
+    std::string newFile() {
+        char s[32];
+        snprintf(s, sizeof(s), ".%ld", next_id++);
+        return base + s;
+    }
+
+    void dirty(Page *pg) {
+        if (pg) pg->dirty = true;
+    }
+
+    // Counts nodes added to a loaded page and drops other pages if the
+    // budget is exceeded.
+    void grow(Page *pg, size_t b) {
+        pg->bytes += b;
+        st.bytes += b;
+        if (st.bytes > budget) evict(pg);
+    }
+
+    // Frees the nodes of a page and forgets it.
+    void dropPage(Page *pg) {
+        if (pg->loaded) {
+            st.bytes -= pg->bytes;
+            lru.erase(pg->lru);
+        }
+        mem.collapse(pg->node, pg->node->value);
+        pages.erase(pg->node);
+        delete pg;
+    }
+
+    // Forgets the pages below n (level < page_level).
+    void dropPages(RawNode *n, int level) {
+        if (!n->child) return;
+        for (int i=0;i<8;i++) {
+            RawNode *c = n->child + i;
+            if (level + 1 < page_level) {
+                dropPages(c, level + 1);
+            } else if (Page *pg = find(c)) {
+                dropPage(pg);
+            }
+        }
+    }
+
+    bool writePage(Page *pg) {
+        if (!voxf_write<V>(mem, pg->node, depth - page_level, (dir + pg->file).c_str(), OctreeVoxfNoRef())) {
+            st.errors++;
+            return false;
+        }
+        pg->dirty = false;
+        st.writebacks++;
+        return true;
+    }
+
+    void unload(Page *pg) {
+        st.bytes -= pg->bytes;
+        lru.erase(pg->lru);
+        mem.collapse(pg->node, pg->node->value);
+        pg->loaded = false;
+        pg->bytes = 0;
+        st.evictions++;
+    }
+
+    // Drops least recently used pages other than keep until the loaded
+    // pages fit in the budget.
+    void evict(Page *keep) {
+        while (st.bytes > budget && !lru.empty() && lru.back() != keep) {
+            Page *pg = lru.back();
+            if (pg->dirty && !writePage(pg)) {
+                // keep it, it is the only copy
+                lru.splice(lru.begin(), lru, pg->lru);
+                continue;
+            }
+            unload(pg);
+        }
+    }
+
+    // Moves a page to the front of the LRU, reading it if needed. A page
+    // that cannot be read becomes empty. The page root keeps children, as
+    // hasChild() answered for it before: an empty or single leaf page is
+    // split into 8 leaves.
+    void use(Page *pg) {
+        if (pg->loaded) {
+            st.hits++;
+            lru.splice(lru.begin(), lru, pg->lru);
+            return;
+        }
+        st.misses++;
+        OctreeMappedFile f;
+        OctreeVoxfReader r;
+        if (!f.open((dir + pg->file).c_str()) || !r.parse(f.data(), f.size()) ||
+                !voxf_read<V>(mem, pg->node, depth - page_level, r, OctreeVoxfNoRef())) {
+            st.errors++;
+            mem.collapse(pg->node, V());
+        }
+        if (!pg->node->child) mem.split(pg->node);
+        pg->loaded = true;
+        pg->dirty = false;
+        pg->bytes = count(pg->node);
+        st.bytes += pg->bytes;
+        pg->lru = lru.insert(lru.begin(), pg);
+        evict(pg);
+    }
+
+    void setValue(Node n, long x, long y, long z, long d, V v) {
+        if (d == 0) {
+            if (hasChild(n) || value(n) != v) collapse(n, v);
+            return;
+        }
+        if (!hasChild(n)) {
+            if (value(n) == v) return;
+            split(n);
+            OCTREE_STAT(edits.splits++);
+        }
+        int i=0;
+        if (x&DEPTH_MASK) {i|=1;}
+        if (y&DEPTH_MASK) {i|=2;}
+        if (z&DEPTH_MASK) {i|=4;}
+        setValue(child(n, i), x<<1, y<<1, z<<1, d-1, v);
+
+        for (i=0;i<8;i++) {
+            Node c = child(n, i);
+            if (hasChild(c) || value(c) != v) return;
+        }
+        collapse(n, v);
+        OCTREE_STAT(edits.merges++);
+    }
+
+    void reset() {
+        while (!pages.empty()) dropPage(pages.begin()->second);
+        mem.collapse(mem.root(), mem.value(mem.root()));
+    }
+
+public:
+    OctreePagedStorage(V v = V()) : mem(v), depth(0), page_level(0), next_id(0), budget((size_t)256 << 20) {
+        memset(&st, 0, sizeof(st));
+    }
+    ~OctreePagedStorage() {
+        reset();
+    }
+
+    // Pages the current tree (of the given depth) below page_level to
+    // the world file path. Nothing is written until flush().
+    bool create(const char *p, int d, int level) {
+        if (level <= 0 || level >= d) return false;
+        while (!pages.empty()) dropPage(pages.begin()->second);
+        path = p;
+        size_t s = path.find_last_of("/\\");
+        dir = s == std::string::npos ? "" : path.substr(0, s + 1);
+        base = path.substr(dir.size());
+        depth = d;
+        page_level = level;
+        next_id = 0;
+        addPages(mem.root(), 0);
+        return true;
+    }
+
+    // Opens a world written by flush(). The pages are read on demand.
+    bool open(const char *p, int d, int level) {
+        reset();
+        if (!create(p, d, level)) return false;
+        OctreeMappedFile f;
+        OctreeVoxfReader r;
+        if (!f.open(p) || !r.parse(f.data(), f.size())) return false;
+        PageRef ref(*this, r.refs);
+        bool ok = voxf_read<V>(*this, root(), depth, r, ref);
+        for (size_t i=0;i<r.refs.size();i++) {
+            // new pages are named base.<n> after the ones in the file
+            const std::string &f = r.refs[i];
+            if (f.compare(0, base.size() + 1, base + ".") != 0) continue;
+            long n = strtol(f.c_str() + base.size() + 1, NULL, 10);
+            if (n >= next_id) next_id = n + 1;
+        }
+        if (!ok) reset();
+        return ok;
+    }
+
+    // Writes the dirty pages and the world file.
+    bool flush() {
+        if (page_level == 0) return false;
+        std::vector<std::string> names;
+        RefIds ids(*this);
+        for (typename std::map<RawNode*, Page*>::iterator it=pages.begin();it!=pages.end();++it) {
+            Page *pg = it->second;
+            if (pg->loaded && !pg->node->child) continue;
+            if (pg->loaded && pg->dirty && !writePage(pg)) return false;
+            ids.ids[pg->node] = (long)names.size();
+            names.push_back(pg->file);
+        }
+        return voxf_write<V>(*this, root(), depth, path.c_str(), ids, &names);
+    }
+
+    void setMemoryBudget(size_t bytes) {
+        budget = bytes;
+        if (!lru.empty()) evict(NULL);
+    }
+
+    OctreePageStats stats() const {
+        OctreePageStats s = st;
+        s.pages = (long)pages.size();
+        s.loaded = (long)lru.size();
+        s.budget = budget;
+        return s;
+    }
+
+    void resetStats() {
+        st.hits = st.misses = st.evictions = st.writebacks = st.errors = 0;
+    }
+
+    // Nodes in memory: the levels above the pages and the loaded pages.
+    size_t bytesReserved() const {
+        return mem.getAllocator().bytesReserved();
+    }
+
+#if _OCTREE_STATS
+    const OctreeEditStats& editStats() const {
+        return edits;
+    }
+#endif
+
+    inline Node root() const {
+        return Node(mem.root(), NULL, 0);
+    }
+    inline bool hasChild(Node n) const {
+        if (n.level == page_level && page_level) {
+            Page *pg = find(n.p);
+            if (pg && !pg->loaded) return true;
+        }
+        return n.p->child != NULL;
+    }
+    inline const V& value(Node n) const {
+        return n.p->value;
+    }
+    inline Node child(Node n, int i) const {
+        Page *pg = n.page;
+        if (n.level == page_level && page_level) {
+            pg = find(n.p);
+            if (pg) const_cast<OctreePagedStorage*>(this)->use(pg);
+        }
+        return Node(n.p->child + i, n.level < page_level ? NULL : pg, n.level + 1);
+    }
+    inline Node mutableChild(Node n, int i) {
+        return child(n, i);
+    }
+
+    void split(Node n) {
+        mem.split(n.p);
+        Page *pg = n.page;
+        if (n.level == page_level && page_level) {
+            pg = find(n.p);
+            if (!pg) pg = addPage(n.p, newFile(), true);
+        } else {
+            dirty(pg);
+        }
+        if (pg && pg->loaded) grow(pg, sizeof(RawNode) * 8);
+    }
+    void collapse(Node n, V v) {
+        if (page_level && n.level < page_level) {
+            dropPages(n.p, n.level);
+        } else if (page_level && n.level == page_level) {
+            if (Page *pg = find(n.p)) dropPage(pg);
+        } else if (n.page && n.p->child) {
+            size_t b = count(n.p);
+            n.page->bytes -= b;
+            st.bytes -= b;
+        }
+        mem.collapse(n.p, v);
+        dirty(n.page);
+    }
+    void swap(Node a, Node b) {
+        if (page_level && a.level == page_level) {
+            Page *pa = find(a.p), *pb = find(b.p);
+            pages.erase(a.p);
+            pages.erase(b.p);
+            if (pb) pages[pb->node = a.p] = pb;
+            if (pa) pages[pa->node = b.p] = pa;
+        }
+        mem.swap(a.p, b.p);
+        dirty(a.page);
+        dirty(b.page);
+    }
+
+    V getValue(long x,long y,long z, long d) const {
+        Node n = root();
+        for (;d>0 && hasChild(n);d--) {
+            int i=0;
+            if (x&DEPTH_MASK) {i|=1;}
+            if (y&DEPTH_MASK) {i|=2;}
+            if (z&DEPTH_MASK) {i|=4;}
+            n = child(n, i);
+            x<<=1; y<<=1; z<<=1;
+        }
+        return value(n);
+    }
+    void setValue(long x,long y,long z, long d, V v) {
+        OCTREE_STAT(edits.sets++);
+        setValue(root(), x, y, z, d, v);
+    }
+
+private:
+    // voxf_read callback: page roots of the world file.
+    struct PageRef {
+        OctreePagedStorage &s;
+        const std::vector<std::string> &refs;
+        PageRef(OctreePagedStorage &st, const std::vector<std::string> &r) : s(st), refs(r) {}
+        bool operator()(Node n, uint32_t id) const {
+            if (n.level != s.page_level || id >= refs.size() || s.find(n.p)) return false;
+            s.addPage(n.p, refs[id], false);
+            return true;
+        }
+    };
+
+    // voxf_write callback: ref_id of the page roots.
+    struct RefIds {
+        const OctreePagedStorage &s;
+        std::map<RawNode*, long> ids;
+        explicit RefIds(const OctreePagedStorage &st) : s(st) {}
+        long operator()(Node n) const {
+            if (n.level != s.page_level) return -1;
+            typename std::map<RawNode*, long>::const_iterator it = ids.find(n.p);
+            return it == ids.end() ? -1 : it->second;
+        }
+    };
+
+    void addPages(RawNode *n, int level) {
+        if (!n->child) return;
+        if (level == page_level) {
+            addPage(n, newFile(), true);
+            return;
+        }
+        for (int i=0;i<8;i++) addPages(n->child + i, level + 1);
+    }
+};
+
+template <typename V>
+inline size_t octree_storage_bytes(const OctreePagedStorage<V> &s) {
+    return s.bytesReserved();
+}
+
+// Reading a node may load a page and reorders the page LRU.
+template <typename V>
+inline bool octree_parallel_read(const OctreePagedStorage<V> &) {
+    return false;
+}
+
+#endif
@@ -0,0 +1,141 @@
+#ifndef _OCTREE_POOL_H
+#define _OCTREE_POOL_H
+
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+
+// Fixed size worker pool with work stealing.
+//
+// run(n, f) calls f(i, worker) once for every i in [0,n). The tasks are
+// split into contiguous blocks, one queue per worker. A worker takes tasks
+// from the front of its own queue and steals from the back of the others
+// when it runs out. The calling thread works as worker 0, so a pool of
+// size 1 starts no threads.
+class OctreeWorkerPool {
+    struct Queue {
+        std::mutex mutex;
+        std::deque<int> tasks;
+    };
+
+    std::vector<std::thread> threads;
+    std::vector<Queue*> queues;
+    const std::function<void(int,int)> *job;
+
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::condition_variable idle;
+    int generation;
+    int busy;
+    bool quit;
+
+    OctreeWorkerPool(const OctreeWorkerPool&);
+    OctreeWorkerPool& operator=(const OctreeWorkerPool&);
+
+    bool pop(int w, int &task) {
+        Queue &q = *queues[w];
+        std::lock_guard<std::mutex> lk(q.mutex);
+        if (q.tasks.empty()) return false;
+        task = q.tasks.front();
+        q.tasks.pop_front();
+        return true;
+    }
+
+    bool steal(int w, int &task) {
+        for (size_t k=1;k<queues.size();k++) {
+            Queue &q = *queues[(w+k)%queues.size()];
+            std::lock_guard<std::mutex> lk(q.mutex);
+            if (q.tasks.empty()) continue;
+            task = q.tasks.back();
+            q.tasks.pop_back();
+            return true;
+        }
+        return false;
+    }
+
+    void work(int w) {
+        int task;
+        while (pop(w, task) || steal(w, task)) {
+            (*job)(task, w);
+        }
+    }
+
+    void loop(int w) {
+        int seen = 0;
+        for (;;) {
+            {
+                std::unique_lock<std::mutex> lk(mutex);
+                while (!quit && generation == seen) wake.wait(lk);
+                if (quit) return;
+                seen = generation;
+            }
+            work(w);
+            {
+                std::lock_guard<std::mutex> lk(mutex);
+                if (--busy == 0) idle.notify_all();
+            }
+        }
+    }
+
+public:
+    // n: number of workers including the calling thread. 0: one per core.
+    explicit OctreeWorkerPool(int n = 0) : job(NULL), generation(0), busy(0), quit(false) {
+        if (n <= 0) n = (int)std::thread::hardware_concurrency();
+        if (n <= 0) n = 1;
+        for (int i=0;i<n;i++) {
+            queues.push_back(new Queue());
+        }
+        for (int i=1;i<n;i++) {
+            threads.push_back(std::thread(&OctreeWorkerPool::loop, this, i));
+        }
+    }
+
+    ~OctreeWorkerPool() {
+        {
+            std::lock_guard<std::mutex> lk(mutex);
+            quit = true;
+        }
+        wake.notify_all();
+        for (size_t i=0;i<threads.size();i++) {
+            threads[i].join();
+        }
+        for (size_t i=0;i<queues.size();i++) {
+            delete queues[i];
+        }
+    }
+
+    int size() const {
+        return (int)queues.size();
+    }
+
+    // Returns when all tasks are done. Not reentrant.
+    void run(int n, const std::function<void(int,int)> &f) {
+        if (n <= 0) return;
+        int w = size();
+        {
+            std::lock_guard<std::mutex> lk(mutex);
+            job = &f;
+            for (int i=0;i<w;i++) {
+                Queue &q = *queues[i];
+                std::lock_guard<std::mutex> qlk(q.mutex);
+                q.tasks.clear();
+                for (int t=(int)((long)n*i/w);t<(int)((long)n*(i+1)/w);t++) {
+                    q.tasks.push_back(t);
+                }
+            }
+            busy = (int)threads.size();
+            generation++;
+        }
+        wake.notify_all();
+        work(0);
+
+        std::unique_lock<std::mutex> lk(mutex);
+        while (busy > 0) idle.wait(lk);
+        job = NULL;
+    }
+};
+
+#endif
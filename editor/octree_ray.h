@@ -0,0 +1,306 @@
+#ifndef _OCTREE_RAY_H
+#define _OCTREE_RAY_H
+
+#include <cmath>
+#include <limits>
+#include <algorithm>
+#include "octree_node.h"
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define _OCTREE_RAY_AVX2 1
+#define _OCTREE_RAY_SSE 0
+#define OCTREE_RAY_LANES 16
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define _OCTREE_RAY_AVX2 0
+#define _OCTREE_RAY_SSE 1
+#define OCTREE_RAY_LANES 8
+#else
+#define _OCTREE_RAY_AVX2 0
+#define _OCTREE_RAY_SSE 0
+#define OCTREE_RAY_LANES 4
+#endif
+
+
+// Ray in cell units: the tree is the cube [0,size)^3 and cell (x,y,z) is
+// [x,x+1)*[y,y+1)*[z,z+1). Points are o + t*d for t in [0,tmax].
+struct OctreeRay {
+    float o[3];
+    float d[3];
+    float tmax;
+
+    OctreeRay() : tmax(std::numeric_limits<float>::infinity()) {
+        o[0] = o[1] = o[2] = 0;
+        d[0] = d[1] = d[2] = 0;
+    }
+    OctreeRay(float ox, float oy, float oz, float dx, float dy, float dz,
+            float t = std::numeric_limits<float>::infinity()) : tmax(t) {
+        o[0] = ox; o[1] = oy; o[2] = oz;
+        d[0] = dx; d[1] = dy; d[2] = dz;
+    }
+};
+
+// First cell with a value other than V() on a ray.
+// n: normal of the face the ray entered it through (0,0,0 if the ray
+// starts inside). t: o + t*d is the entry point.
+struct OctreeRayHit {
+    bool hit;
+    long x, y, z;
+    int n[3];
+    float t;
+};
+
+
+// Hierarchical DDA: steps from leaf to leaf, so an empty node is crossed
+// in one step whatever its size. The leaf path is kept on a stack and a
+// step goes up only to the common ancestor of the two cells.
+template <typename V, typename S>
+bool octree_raycast(const S &s, int depth, const OctreeRay &ray, OctreeRayHit &hit) {
+    typedef typename S::Node Node;
+    const double inf = std::numeric_limits<double>::infinity();
+    const long size = 1L << depth;
+    hit.hit = false;
+
+    double o[3], d[3], inv[3];
+    double t0 = 0, t1 = ray.tmax;
+    int axis = -1;
+    for (int i=0;i<3;i++) {
+        o[i] = ray.o[i];
+        d[i] = ray.d[i];
+        if (d[i] == 0) {
+            if (o[i] < 0 || o[i] >= size) return false;
+            inv[i] = inf;
+            continue;
+        }
+        inv[i] = 1.0 / d[i];
+        double ta = -o[i] * inv[i], tb = (size - o[i]) * inv[i];
+        if (ta > tb) std::swap(ta, tb);
+        if (ta > t0) {
+            t0 = ta;
+            axis = i;
+        }
+        if (tb < t1) t1 = tb;
+    }
+    if (t0 > t1) return false;
+
+    long c[3];
+    for (int i=0;i<3;i++) {
+        c[i] = (long)std::floor(o[i] + t0 * d[i]);
+        c[i] = c[i] < 0 ? 0 : c[i] >= size ? size-1 : c[i];
+    }
+    if (axis >= 0) c[axis] = d[axis] > 0 ? 0 : size-1;
+
+    Node stack[MAX_DEPTH+1];
+    int sp = 0;
+    stack[0] = s.root();
+    for (;;) {
+        while (sp < depth && s.hasChild(stack[sp])) {
+            int b = depth-sp-1;
+            int i = (int)(((c[0] >> b) & 1) | (((c[1] >> b) & 1) << 1) | (((c[2] >> b) & 1) << 2));
+            stack[sp+1] = s.child(stack[sp], i);
+            sp++;
+        }
+        long leaf = 1L << (depth-sp);
+        long lo[3] = {c[0] & ~(leaf-1), c[1] & ~(leaf-1), c[2] & ~(leaf-1)};
+
+        if (s.value(stack[sp]) != V()) {
+            hit.hit = true;
+            hit.x = c[0];
+            hit.y = c[1];
+            hit.z = c[2];
+            for (int i=0;i<3;i++) hit.n[i] = i != axis ? 0 : d[i] > 0 ? -1 : 1;
+            hit.t = (float)t0;
+            return true;
+        }
+
+        // leave the leaf through the nearest face
+        double te = inf;
+        for (int i=0;i<3;i++) {
+            if (d[i] == 0) continue;
+            double t = ((d[i] > 0 ? lo[i] + leaf : lo[i]) - o[i]) * inv[i];
+            if (t < te) {
+                te = t;
+                axis = i;
+            }
+        }
+        if (te > t1) return false;
+        t0 = te;
+        long diff = 0;
+        for (int i=0;i<3;i++) {
+            long n;
+            if (i == axis) {
+                n = d[i] > 0 ? lo[i] + leaf : lo[i] - 1;
+                if (n < 0 || n >= size) return false;
+            } else {
+                n = (long)std::floor(o[i] + t0 * d[i]);
+                n = n < lo[i] ? lo[i] : n >= lo[i] + leaf ? lo[i] + leaf - 1 : n;
+            }
+            diff |= n ^ lo[i];
+            c[i] = n;
+        }
+        int up = octree_bit_length(diff);
+        if (sp > depth - up) sp = depth - up;
+    }
+}
+
+
+// Packet of OCTREE_RAY_LANES rays for octree_raycast_packet: 2 vectors
+// (AVX2 or SSE) or 4 scalar lanes. Unused lanes have start > end.
+struct OctreeRayPacket {
+    float ox[OCTREE_RAY_LANES], oy[OCTREE_RAY_LANES], oz[OCTREE_RAY_LANES];
+    float ix[OCTREE_RAY_LANES], iy[OCTREE_RAY_LANES], iz[OCTREE_RAY_LANES];
+    float start[OCTREE_RAY_LANES], end[OCTREE_RAY_LANES];
+    // leaf hit so far: origin and size
+    float lx[OCTREE_RAY_LANES], ly[OCTREE_RAY_LANES], lz[OCTREE_RAY_LANES], ls[OCTREE_RAY_LANES];
+    int hit[OCTREE_RAY_LANES];
+    int order;
+};
+
+// Entry t of each lane into the cube (x,y,z,size). Returns the mask of
+// the lanes that enter it before their end (nearest hit so far).
+inline int octree_ray_enter(const OctreeRayPacket &p, float x, float y, float z, float size, float *tn) {
+#if _OCTREE_RAY_AVX2
+    int mask = 0;
+    for (int k=0;k<OCTREE_RAY_LANES;k+=8) {
+        __m256 ox = _mm256_loadu_ps(p.ox+k), oy = _mm256_loadu_ps(p.oy+k), oz = _mm256_loadu_ps(p.oz+k);
+        __m256 ix = _mm256_loadu_ps(p.ix+k), iy = _mm256_loadu_ps(p.iy+k), iz = _mm256_loadu_ps(p.iz+k);
+        __m256 ax = _mm256_mul_ps(_mm256_sub_ps(_mm256_set1_ps(x), ox), ix);
+        __m256 bx = _mm256_mul_ps(_mm256_sub_ps(_mm256_set1_ps(x+size), ox), ix);
+        __m256 ay = _mm256_mul_ps(_mm256_sub_ps(_mm256_set1_ps(y), oy), iy);
+        __m256 by = _mm256_mul_ps(_mm256_sub_ps(_mm256_set1_ps(y+size), oy), iy);
+        __m256 az = _mm256_mul_ps(_mm256_sub_ps(_mm256_set1_ps(z), oz), iz);
+        __m256 bz = _mm256_mul_ps(_mm256_sub_ps(_mm256_set1_ps(z+size), oz), iz);
+        __m256 t0 = _mm256_max_ps(_mm256_max_ps(_mm256_min_ps(ax, bx), _mm256_min_ps(ay, by)),
+                _mm256_max_ps(_mm256_min_ps(az, bz), _mm256_loadu_ps(p.start+k)));
+        __m256 t1 = _mm256_min_ps(_mm256_min_ps(_mm256_max_ps(ax, bx), _mm256_max_ps(ay, by)),
+                _mm256_min_ps(_mm256_max_ps(az, bz), _mm256_loadu_ps(p.end+k)));
+        _mm256_storeu_ps(tn+k, t0);
+        mask |= _mm256_movemask_ps(_mm256_cmp_ps(t0, t1, _CMP_LE_OQ)) << k;
+    }
+    return mask;
+#elif _OCTREE_RAY_SSE
+    int mask = 0;
+    for (int k=0;k<OCTREE_RAY_LANES;k+=4) {
+        __m128 ox = _mm_loadu_ps(p.ox+k), oy = _mm_loadu_ps(p.oy+k), oz = _mm_loadu_ps(p.oz+k);
+        __m128 ix = _mm_loadu_ps(p.ix+k), iy = _mm_loadu_ps(p.iy+k), iz = _mm_loadu_ps(p.iz+k);
+        __m128 ax = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(x), ox), ix);
+        __m128 bx = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(x+size), ox), ix);
+        __m128 ay = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(y), oy), iy);
+        __m128 by = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(y+size), oy), iy);
+        __m128 az = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(z), oz), iz);
+        __m128 bz = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(z+size), oz), iz);
+        __m128 t0 = _mm_max_ps(_mm_max_ps(_mm_min_ps(ax, bx), _mm_min_ps(ay, by)),
+                _mm_max_ps(_mm_min_ps(az, bz), _mm_loadu_ps(p.start+k)));
+        __m128 t1 = _mm_min_ps(_mm_min_ps(_mm_max_ps(ax, bx), _mm_max_ps(ay, by)),
+                _mm_min_ps(_mm_max_ps(az, bz), _mm_loadu_ps(p.end+k)));
+        _mm_storeu_ps(tn+k, t0);
+        mask |= _mm_movemask_ps(_mm_cmple_ps(t0, t1)) << k;
+    }
+    return mask;
+#else
+    int mask = 0;
+    for (int k=0;k<OCTREE_RAY_LANES;k++) {
+        float ax = (x - p.ox[k]) * p.ix[k], bx = (x + size - p.ox[k]) * p.ix[k];
+        float ay = (y - p.oy[k]) * p.iy[k], by = (y + size - p.oy[k]) * p.iy[k];
+        float az = (z - p.oz[k]) * p.iz[k], bz = (z + size - p.oz[k]) * p.iz[k];
+        float t0 = (std::max)((std::max)((std::min)(ax, bx), (std::min)(ay, by)), (std::max)((std::min)(az, bz), p.start[k]));
+        float t1 = (std::min)((std::min)((std::max)(ax, bx), (std::max)(ay, by)), (std::min)((std::max)(az, bz), p.end[k]));
+        tn[k] = t0;
+        if (t0 <= t1) mask |= 1 << k;
+    }
+    return mask;
+#endif
+}
+
+// Depth first, children in front to back order for the direction of the
+// first ray. A lane's end is cut at each hit, so the cubes behind it are
+// skipped (the nearest hit wins whatever the order).
+template <typename V, typename S>
+void octree_raycast_packet(const S &s, typename S::Node n, float x, float y, float z, float size, OctreeRayPacket &p) {
+    float tn[OCTREE_RAY_LANES];
+    int mask = octree_ray_enter(p, x, y, z, size, tn);
+    if (!mask) return;
+    if (!s.hasChild(n)) {
+        for (int k=0;k<OCTREE_RAY_LANES;k++) {
+            if (!(mask & (1<<k)) || (p.hit[k] && tn[k] >= p.end[k])) continue;
+            p.hit[k] = 1;
+            p.end[k] = tn[k];
+            p.lx[k] = x;
+            p.ly[k] = y;
+            p.lz[k] = z;
+            p.ls[k] = size;
+        }
+        return;
+    }
+    float half = size * 0.5f;
+    for (int j=0;j<8;j++) {
+        int i = j ^ p.order;
+        typename S::Node c = s.child(n, i);
+        if (!s.hasChild(c) && s.value(c) == V()) continue;
+        octree_raycast_packet<V>(s, c, x+half*(i&1), y+half*((i>>1)&1), z+half*((i>>2)&1), half, p);
+    }
+}
+
+// Casts n rays in packets of OCTREE_RAY_LANES. Rays next to each other
+// should be coherent (e.g. neighbor pixels). Returns the number of hits.
+template <typename V, typename S>
+long octree_raycast(const S &s, int depth, const OctreeRay *rays, OctreeRayHit *hits, long n) {
+    const float big = 1e30f;
+    const float size = (float)(1L << depth);
+    long count = 0;
+    for (long r=0;r<n;r+=OCTREE_RAY_LANES) {
+        OctreeRayPacket p;
+        int lanes = (int)(std::min)((long)OCTREE_RAY_LANES, n-r);
+        for (int k=0;k<OCTREE_RAY_LANES;k++) {
+            const OctreeRay &ray = rays[k < lanes ? r+k : r];
+            float inv[3];
+            for (int i=0;i<3;i++) {
+                inv[i] = ray.d[i] != 0 ? 1.0f / ray.d[i] : big;
+            }
+            p.ox[k] = ray.o[0]; p.oy[k] = ray.o[1]; p.oz[k] = ray.o[2];
+            p.ix[k] = inv[0]; p.iy[k] = inv[1]; p.iz[k] = inv[2];
+            p.start[k] = k < lanes ? 0 : 1;
+            p.end[k] = k < lanes ? (std::min)(ray.tmax, big) : 0;
+            p.hit[k] = 0;
+        }
+        const OctreeRay &first = rays[r];
+        p.order = (first.d[0] < 0 ? 1 : 0) | (first.d[1] < 0 ? 2 : 0) | (first.d[2] < 0 ? 4 : 0);
+        if (s.hasChild(s.root()) || s.value(s.root()) != V()) {
+            octree_raycast_packet<V>(s, s.root(), 0, 0, 0, size, p);
+        }
+
+        for (int k=0;k<lanes;k++) {
+            const OctreeRay &ray = rays[r+k];
+            OctreeRayHit &h = hits[r+k];
+            h.hit = p.hit[k] != 0;
+            if (!h.hit) continue;
+            count++;
+            // cell at the entry point, entry face: the slab entered last
+            float lo[3] = {p.lx[k], p.ly[k], p.lz[k]}, t = p.end[k];
+            long c[3];
+            float te = 0;
+            int axis = -1;
+            for (int i=0;i<3;i++) {
+                float v = std::floor(ray.o[i] + t * ray.d[i]);
+                v = v < lo[i] ? lo[i] : v > lo[i] + p.ls[k] - 1 ? lo[i] + p.ls[k] - 1 : v;
+                c[i] = (long)v;
+                if (ray.d[i] == 0) continue;
+                float ta = ((ray.d[i] > 0 ? lo[i] : lo[i] + p.ls[k]) - ray.o[i]) / ray.d[i];
+                if (ta > te) {
+                    te = ta;
+                    axis = i;
+                }
+            }
+            if (axis >= 0) c[axis] = (long)(ray.d[axis] > 0 ? lo[axis] : lo[axis] + p.ls[k] - 1);
+            h.x = c[0];
+            h.y = c[1];
+            h.z = c[2];
+            for (int i=0;i<3;i++) h.n[i] = i != axis ? 0 : ray.d[i] > 0 ? -1 : 1;
+            h.t = t;
+        }
+    }
+    return count;
+}
+
+#endif
@@ -0,0 +1,96 @@
+#ifndef _OCTREE_REGION_H
+#define _OCTREE_REGION_H
+
+#include <algorithm>
+
+// Axis aligned box of cells. [x1,x2) x [y1,y2) x [z1,z2)
+struct OctreeBox {
+    int x1, y1, z1;
+    int x2, y2, z2;
+
+    OctreeBox() : x1(0), y1(0), z1(0), x2(0), y2(0), z2(0) {}
+    OctreeBox(int x, int y, int z, int w, int h, int d) :
+        x1(x), y1(y), z1(z), x2(x+w), y2(y+h), z2(z+d) {}
+
+    bool empty() const {
+        return x1>=x2 || y1>=y2 || z1>=z2;
+    }
+
+    // extends the box to cover the cube (x,y,z,size).
+    void add(int x, int y, int z, int size) {
+        if (empty()) {
+            *this = OctreeBox(x, y, z, size, size, size);
+            return;
+        }
+        if (x < x1) x1 = x;
+        if (y < y1) y1 = y;
+        if (z < z1) z1 = z;
+        if (x+size > x2) x2 = x+size;
+        if (y+size > y2) y2 = y+size;
+        if (z+size > z2) z2 = z+size;
+    }
+
+    bool intersects(long x, long y, long z, long size) const {
+        return x < x2 && x+size > x1 && y < y2 && y+size > y1 && z < z2 && z+size > z1;
+    }
+
+    bool contains(long x, long y, long z, long size) const {
+        return x >= x1 && x+size <= x2 && y >= y1 && y+size <= y2 && z >= z1 && z+size <= z2;
+    }
+
+    // cells of the cube (x,y,z,size) in the box.
+    long overlap(long x, long y, long z, long size) const {
+        long w = std::min<long>(x+size, x2) - std::max<long>(x, x1);
+        long h = std::min<long>(y+size, y2) - std::max<long>(y, y1);
+        long d = std::min<long>(z+size, z2) - std::max<long>(z, z1);
+        return w > 0 && h > 0 && d > 0 ? w*h*d : 0;
+    }
+};
+
+
+// Region classifiers for Octree::applyFunc.
+//   int operator()(x, y, z, size): classifies the cube of cells (x,y,z,size).
+enum {
+    OCTREE_REGION_OUT = 0,
+    OCTREE_REGION_ALL = 1,
+    OCTREE_REGION_PARTIAL = 2,
+};
+
+// cells with (x-cx)^2+(y-cy)^2+(z-cz)^2 < r^2 (same cells as scrapeSphere)
+struct OctreeSphereFunc {
+    long cx, cy, cz, rr;
+
+    OctreeSphereFunc(long x, long y, long z, long r) : cx(x), cy(y), cz(z), rr(r*r) {}
+
+    static inline long nearest(long c, long x, long size) {
+        if (c < x) return x - c;
+        if (c > x+size-1) return c - (x+size-1);
+        return 0;
+    }
+    static inline long farthest(long c, long x, long size) {
+        long a = c - x, b = x+size-1 - c;
+        return a > b ? a : b;
+    }
+
+    int operator()(long x, long y, long z, long size) const {
+        long dx = nearest(cx, x, size), dy = nearest(cy, y, size), dz = nearest(cz, z, size);
+        if (dx*dx+dy*dy+dz*dz >= rr) return OCTREE_REGION_OUT;
+        dx = farthest(cx, x, size); dy = farthest(cy, y, size); dz = farthest(cz, z, size);
+        if (dx*dx+dy*dy+dz*dz < rr) return OCTREE_REGION_ALL;
+        return OCTREE_REGION_PARTIAL;
+    }
+};
+
+struct OctreeBoxFunc {
+    OctreeBox box;
+
+    OctreeBoxFunc(const OctreeBox &b) : box(b) {}
+
+    int operator()(long x, long y, long z, long size) const {
+        if (box.contains(x, y, z, size)) return OCTREE_REGION_ALL;
+        if (box.intersects(x, y, z, size)) return OCTREE_REGION_PARTIAL;
+        return OCTREE_REGION_OUT;
+    }
+};
+
+#endif
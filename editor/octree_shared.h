@@ -0,0 +1,375 @@
+#ifndef _OCTREE_SHARED_H
+#define _OCTREE_SHARED_H
+
+#include <vector>
+#include <atomic>
+#include <algorithm>
+#include <unordered_map>
+#include <unordered_set>
+#include "octree_node.h"
+#include "octree_dag.h"
+#include "octree_csg.h"
+
+// Storage backend for Octree with reference counted child blocks.
+//
+// A copy of the storage shares every block with the original, so copying
+// is O(1) and gives a snapshot. A shared block is copied before a change
+// (mutableChild), so an edit copies only the blocks on its path and never
+// changes what another copy sees. Counts are atomic: a copy can be read
+// and dropped in another thread while the original is edited.
+template <typename V>
+class OctreeSharedStorage {
+    struct Block;
+
+public:
+    struct SharedNode {
+        V value;
+        Block *child;
+    };
+    typedef SharedNode* Node;
+
+private:
+    struct Block {
+        std::atomic<int> refs;
+        SharedNode n[8];
+    };
+
+    SharedNode element;
+    long copies;
+#if _OCTREE_STATS
+    OctreeEditStats edits;
+#endif
+
+    static std::atomic<long> &live() {
+        static std::atomic<long> n(0);
+        return n;
+    }
+
+    static Block *alloc() {
+        Block *b = new Block();
+        b->refs.store(1, std::memory_order_relaxed);
+        live().fetch_add(1, std::memory_order_relaxed);
+        return b;
+    }
+
+    static Block *retain(Block *b) {
+        if (b) b->refs.fetch_add(1, std::memory_order_relaxed);
+        return b;
+    }
+
+    static void release(Block *b) {
+        if (!b || b->refs.fetch_sub(1, std::memory_order_acq_rel) != 1) return;
+        for (int i=0;i<8;i++) release(b->n[i].child);
+        live().fetch_sub(1, std::memory_order_relaxed);
+        delete b;
+    }
+
+    // Makes the child block of n private to this storage. n must be.
+    inline void own(Node n) {
+        Block *b = n->child;
+        if (b->refs.load(std::memory_order_acquire) == 1) return;
+        Block *c = alloc();
+        for (int i=0;i<8;i++) {
+            c->n[i].value = b->n[i].value;
+            c->n[i].child = retain(b->n[i].child);
+        }
+        n->child = c;
+        release(b);
+        copies++;
+    }
+
+    // blocks with the same values and child blocks are equal. Values of
+    // nodes with children are not used by readers and are ignored.
+    struct BlockHash {
+        size_t operator()(const Block *b) const {
+            size_t h = 0;
+            for (int i=0;i<8;i++) {
+                h = octree_hash_mix(h, b->n[i].child ? std::hash<const void*>()(b->n[i].child) : std::hash<V>()(b->n[i].value));
+            }
+            return h;
+        }
+    };
+    struct BlockEq {
+        bool operator()(const Block *a, const Block *b) const {
+            for (int i=0;i<8;i++) {
+                if (a->n[i].child != b->n[i].child) return false;
+                if (!a->n[i].child && a->n[i].value != b->n[i].value) return false;
+            }
+            return true;
+        }
+    };
+    typedef std::unordered_set<Block*, BlockHash, BlockEq> BlockSet;
+
+    // Replaces the child block of n with an equal block seen before, after
+    // doing so for its children. Blocks in set are done. n must be private
+    // to this storage; a shared block is copied (own) before one of its
+    // children changes, so copies see no change.
+    void compact(Node n, BlockSet &set) {
+        Block *b = n->child;
+        typename BlockSet::iterator it = set.find(b);
+        if (it == set.end()) {
+            for (int i=0;i<8;i++) {
+                if (!b->n[i].child) continue;
+                if (b->refs.load(std::memory_order_acquire) == 1) {
+                    compact(b->n + i, set);
+                    continue;
+                }
+                // compacts a reference of our own; its block counts as shared.
+                SharedNode t = b->n[i];
+                retain(t.child);
+                compact(&t, set);
+                if (t.child == b->n[i].child) {
+                    release(t.child);
+                    continue;
+                }
+                own(n);
+                b = n->child;
+                release(b->n[i].child);
+                b->n[i] = t;
+            }
+            bool leaves = true;
+            for (int i=0;i<8;i++) {
+                leaves &= b->n[i].child == NULL && b->n[i].value == b->n[0].value;
+            }
+            if (leaves) {
+                collapse(n, b->n[0].value);
+                return;
+            }
+            it = set.insert(b).first;
+        }
+        if (*it == b) return;
+        // the children of b are the same blocks as those of *it, so
+        // releasing b frees none of them.
+        n->child = retain(*it);
+        release(b);
+    }
+
+    static uint64_t count(const Block *b, std::unordered_map<const Block*, uint64_t> &seen) {
+        typename std::unordered_map<const Block*, uint64_t>::iterator it = seen.find(b);
+        if (it != seen.end()) return it->second;
+        uint64_t t = 1;
+        for (int i=0;i<8;i++) {
+            if (b->n[i].child) t += count(b->n[i].child, seen);
+        }
+        seen[b] = t;
+        return t;
+    }
+
+    void setValue(Node n, long x, long y, long z, long d, const V &v) {
+        if (d == 0) {
+            collapse(n, v);
+            return;
+        }
+        if (n->child == NULL) {
+            if (n->value == v) return;
+            split(n);
+            OCTREE_STAT(edits.splits++);
+        }
+        int i=0;
+        if (x&DEPTH_MASK) {i|=1;}
+        if (y&DEPTH_MASK) {i|=2;}
+        if (z&DEPTH_MASK) {i|=4;}
+        setValue(mutableChild(n, i), x<<1, y<<1, z<<1, d-1, v);
+
+        for (i=0;i<8;i++) {
+            if (n->child->n[i].child != NULL || n->child->n[i].value != v) return;
+        }
+        collapse(n, v);
+        OCTREE_STAT(edits.merges++);
+    }
+
+public:
+    OctreeSharedStorage(V v = V()) : copies(0) {
+        element.value = v;
+        element.child = NULL;
+    }
+    OctreeSharedStorage(const OctreeSharedStorage &s) : element(s.element), copies(0) {
+        retain(element.child);
+    }
+    OctreeSharedStorage& operator=(const OctreeSharedStorage &s) {
+        retain(s.element.child);
+        release(element.child);
+        element = s.element;
+        return *this;
+    }
+    ~OctreeSharedStorage() {
+        release(element.child);
+    }
+
+    // Blocks copied by edits of this storage.
+    long blocksCopied() const {
+        return copies;
+    }
+    // Blocks of all shared storages.
+    static long blocksLive() {
+        return live().load(std::memory_order_relaxed);
+    }
+    size_t bytesPerBlock() const {
+        return sizeof(Block);
+    }
+#if _OCTREE_STATS
+    // Counters of this storage, not of the copies.
+    const OctreeEditStats& editStats() const {
+        return edits;
+    }
+#endif
+
+    // Merges identical subtrees into shared blocks (hash-consing), so the
+    // tree becomes a DAG. Edits copy a merged block before changing it, as
+    // with snapshots. Blocks shared with copies (e.g. the undo history)
+    // are copied before they change, as by edits, so the copies can be
+    // read in another thread meanwhile.
+    OctreeDagStats compact() {
+        if (element.child) {
+            BlockSet set;
+            compact(&element, set);
+        }
+        return dagStats();
+    }
+
+    // Blocks of the equivalent tree and distinct blocks of this storage.
+    OctreeDagStats dagStats() const {
+        std::unordered_map<const Block*, uint64_t> seen;
+        OctreeDagStats st;
+        st.tree = element.child ? count(element.child, seen) : 0;
+        st.nodes = seen.size();
+        st.bytes = seen.size() * sizeof(Block);
+        return st;
+    }
+
+    inline Node root() const {
+        return const_cast<Node>(&element);
+    }
+    inline bool hasChild(Node n) const {
+        return n->child != NULL;
+    }
+    inline const V& value(Node n) const {
+        return n->value;
+    }
+    inline Node child(Node n, int i) const {
+        return n->child->n + i;
+    }
+    // n must come from root() or mutableChild().
+    inline Node mutableChild(Node n, int i) {
+        own(n);
+        return n->child->n + i;
+    }
+
+    void split(Node n) {
+        Block *b = alloc();
+        for (int i=0;i<8;i++) {
+            b->n[i].value = n->value;
+            b->n[i].child = NULL;
+        }
+        n->child = b;
+    }
+    void collapse(Node n, V v) {
+        release(n->child);
+        n->child = NULL;
+        n->value = v;
+    }
+    void swap(Node a, Node b) {
+        std::swap(a->value, b->value);
+        std::swap(a->child, b->child);
+    }
+    // n becomes the subtree from (of any shared storage), sharing its
+    // blocks. n must come from root() or mutableChild().
+    void share(Node n, Node from) {
+        Block *b = retain(from->child);
+        release(n->child);
+        n->child = b;
+        n->value = from->value;
+    }
+
+    inline V getValue(long x,long y,long z, long depth) const {
+        const SharedNode *n = &element;
+        for (;depth>0 && n->child;depth--) {
+            int i=0;
+            if (x&DEPTH_MASK) {i|=1;}
+            if (y&DEPTH_MASK) {i|=2;}
+            if (z&DEPTH_MASK) {i|=4;}
+            n = n->child->n + i;
+            x<<=1; y<<=1; z<<=1;
+        }
+        return n->value;
+    }
+    void setValue(long x,long y,long z, long depth, V v) {
+        OCTREE_STAT(edits.sets++);
+        setValue(root(), x, y, z, depth, v);
+    }
+};
+
+// Distinct blocks reachable from s, also those shared with copies.
+template <typename V>
+inline size_t octree_storage_bytes(const OctreeSharedStorage<V> &s) {
+    return sizeof(s) + s.dagStats().bytes;
+}
+
+// Octree::combine shares the blocks of the other tree (see octree_csg.h).
+template <typename V>
+inline bool octree_share(OctreeSharedStorage<V> &s, typename OctreeSharedStorage<V>::Node n,
+        const OctreeSharedStorage<V> &, typename OctreeSharedStorage<V>::Node from) {
+    s.share(n, from);
+    return true;
+}
+
+
+// Undo/redo stacks of storage copies. With OctreeSharedStorage a state
+// costs O(1) to keep plus the blocks the later edits copied.
+template <typename S>
+class OctreeHistory {
+    std::vector<S> undos;
+    std::vector<S> redos;
+    size_t limit;
+    int group;
+    bool recorded;
+
+public:
+    OctreeHistory(size_t l = 100) : limit(l), group(0), recorded(false) {}
+
+    // Pushes the state before an edit. Between begin() and end() only the
+    // first edit is recorded, so the group is undone as one step.
+    void record(const S &before) {
+        if (group && recorded) return;
+        recorded = group > 0;
+        undos.push_back(before);
+        if (undos.size() > limit) undos.erase(undos.begin());
+        redos.clear();
+    }
+
+    void begin() {
+        if (group++ == 0) recorded = false;
+    }
+    void end() {
+        if (group > 0) group--;
+    }
+
+    // Replaces s with the state before the last edit.
+    bool undo(S &s) {
+        if (undos.empty()) return false;
+        redos.push_back(s);
+        s = undos.back();
+        undos.pop_back();
+        return true;
+    }
+    bool redo(S &s) {
+        if (redos.empty()) return false;
+        undos.push_back(s);
+        s = redos.back();
+        redos.pop_back();
+        return true;
+    }
+
+    bool canUndo() const {
+        return !undos.empty();
+    }
+    bool canRedo() const {
+        return !redos.empty();
+    }
+    void clear() {
+        undos.clear();
+        redos.clear();
+    }
+};
+
+#endif
@@ -0,0 +1,139 @@
+#ifndef _OCTREE_STATS_H
+#define _OCTREE_STATS_H
+
+#include <map>
+#include <vector>
+#include <chrono>
+#include <cstddef>
+#include <stdint.h>
+
+// 1: storages count the splits and merges of setValue (editStats()) and
+// GLOctree times the phases of its meshers (meshStats()). 0: the counters
+// and clocks are compiled out.
+#ifndef _OCTREE_STATS
+#define _OCTREE_STATS 0
+#endif
+
+#if _OCTREE_STATS
+#define OCTREE_STAT(x) (x)
+// The rest of the scope is spent in phase p of the clock c.
+#define OCTREE_PHASE(c, p) OCTREE_PHASE_(c, p, __LINE__)
+#define OCTREE_PHASE_(c, p, l) OCTREE_PHASE__(c, p, l)
+#define OCTREE_PHASE__(c, p, l) OctreePhase octree_phase_##l(c, p)
+#else
+#define OCTREE_STAT(x) ((void)0)
+#define OCTREE_PHASE(c, p) ((void)0)
+#endif
+
+
+// Counters of setValue (with _OCTREE_STATS).
+struct OctreeEditStats {
+    uint64_t sets;    // setValue calls
+    uint64_t splits;  // leaves split into 8 children
+    uint64_t merges;  // 8 equal leaves merged into their parent
+
+    OctreeEditStats() : sets(0), splits(0), merges(0) {}
+};
+
+// Shape of a tree (Octree::stats()). Level 0 is the root.
+template <typename V>
+struct OctreeTreeStats {
+    std::vector<uint64_t> nodes;   // nodes per level
+    std::vector<uint64_t> leaves;  // leaves per level
+    std::map<V, uint64_t> values;  // leaves per value
+    std::map<V, uint64_t> cells;   // cells per value (depth <= 21)
+    size_t bytes;                  // held by the storage, 0 if unknown
+
+    explicit OctreeTreeStats(int depth = 0) : nodes(depth+1), leaves(depth+1), bytes(0) {}
+
+    uint64_t nodeCount() const {
+        uint64_t n = 0;
+        for (size_t i=0;i<nodes.size();i++) n += nodes[i];
+        return n;
+    }
+    uint64_t leafCount() const {
+        uint64_t n = 0;
+        for (size_t i=0;i<leaves.size();i++) n += leaves[i];
+        return n;
+    }
+    // deepest level with a leaf
+    int height() const {
+        int h = (int)leaves.size()-1;
+        while (h > 0 && leaves[h] == 0) h--;
+        return h;
+    }
+};
+
+// Bytes held by a storage, for OctreeTreeStats. Storages overload it
+// next to their class; found at instantiation by ADL.
+template <typename S>
+inline size_t octree_storage_bytes(const S &) {
+    return 0;
+}
+
+
+// Output of the last mesher run (GLOctree::meshStats()). The phases are
+// seconds summed over the worker threads, kept with _OCTREE_STATS.
+struct OctreeMeshStats {
+    double traversal;  // tree walk and everything not below
+    double neighbors;  // neighbor lookups (make_vartex2: solid chunk tests)
+    double adjust;     // smoothed corners (adjust_vart, corner_vart)
+    double emission;   // writing vertices and indices
+    long lookups;      // neighbor lookups
+    long chunks;       // chunks built
+    long verts;        // vertices of the mesh
+    std::vector<long> chunk_verts;  // per chunk, as chunks are stored
+
+    OctreeMeshStats() : traversal(0), neighbors(0), adjust(0), emission(0), lookups(0), chunks(0), verts(0) {}
+
+    double total() const {
+        return traversal + neighbors + adjust + emission;
+    }
+    void add(const OctreeMeshStats &s) {
+        traversal += s.traversal;
+        neighbors += s.neighbors;
+        adjust += s.adjust;
+        emission += s.emission;
+        lookups += s.lookups;
+        chunks += s.chunks;
+    }
+};
+
+// Splits time into phases: the time since the last switch goes to the
+// current phase. A clock read per switch, so phases are exclusive and
+// nest (see OctreePhase).
+class OctreePhaseClock {
+    typedef std::chrono::steady_clock Clock;
+    double *cur;
+    Clock::time_point t;
+
+public:
+    OctreePhaseClock() : cur(NULL) {}
+
+    // Makes p (NULL: none) the current phase. Returns the previous one.
+    double *enter(double *p) {
+        Clock::time_point now = Clock::now();
+        if (cur) *cur += std::chrono::duration<double>(now - t).count();
+        t = now;
+        double *prev = cur;
+        cur = p;
+        return prev;
+    }
+};
+
+// Phase of a scope: the previous phase goes on at the end.
+class OctreePhase {
+    OctreePhaseClock &c;
+    double *prev;
+
+    OctreePhase(const OctreePhase&);
+    OctreePhase& operator=(const OctreePhase&);
+
+public:
+    OctreePhase(OctreePhaseClock &clock, double &p) : c(clock), prev(clock.enter(&p)) {}
+    ~OctreePhase() {
+        c.enter(prev);
+    }
+};
+
+#endif
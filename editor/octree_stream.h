@@ -0,0 +1,212 @@
+#ifndef _OCTREE_STREAM_H
+#define _OCTREE_STREAM_H
+
+#include <cstdio>
+#include <cstring>
+#include <vector>
+#include <istream>
+#include <ostream>
+#include <stdint.h>
+#include <type_traits>
+
+// Streaming format of Octree::save/load
+//
+//   "OCTS", version, depth, value codec, sizeof(V)     (8 bytes)
+//   root: 0 + value (leaf) or 1 + node record
+//
+// Node records in depth first order. A record is one byte with bit i set
+// if child i has children, then (unless all have) one byte with bit i set
+// if leaf child i has the same value as the previous leaf, then the other
+// leaf values. The records of the child nodes follow in child order.
+// Values of integral types are zigzag varints, others are written as is.
+
+static const uint8_t OCTREE_STREAM_VERSION = 1;
+
+enum {
+    OCTREE_CODEC_VARINT = 0,
+    OCTREE_CODEC_FIXED = 1,
+};
+
+
+// Sinks: bool write(const void *p, size_t n)
+
+struct OctreeVectorSink {
+    std::vector<char> &buf;
+    explicit OctreeVectorSink(std::vector<char> &b) : buf(b) {}
+    bool write(const void *p, size_t n) {
+        buf.insert(buf.end(), (const char*)p, (const char*)p + n);
+        return true;
+    }
+};
+
+struct OctreeFileSink {
+    FILE *fp;
+    explicit OctreeFileSink(FILE *f) : fp(f) {}
+    bool write(const void *p, size_t n) {
+        return fwrite(p, 1, n, fp) == n;
+    }
+};
+
+struct OctreeOstreamSink {
+    std::ostream &os;
+    explicit OctreeOstreamSink(std::ostream &o) : os(o) {}
+    bool write(const void *p, size_t n) {
+        os.write((const char*)p, (std::streamsize)n);
+        return os.good();
+    }
+};
+
+// Sources: size_t read(void *p, size_t n), returns the bytes read.
+
+struct OctreeMemorySource {
+    const char *ptr;
+    size_t size, pos;
+    OctreeMemorySource(const void *p, size_t n) : ptr((const char*)p), size(n), pos(0) {}
+    explicit OctreeMemorySource(const std::vector<char> &b) : ptr(b.empty() ? NULL : &b[0]), size(b.size()), pos(0) {}
+    size_t read(void *p, size_t n) {
+        if (n > size - pos) n = size - pos;
+        if (n) memcpy(p, ptr + pos, n);
+        pos += n;
+        return n;
+    }
+};
+
+struct OctreeFileSource {
+    FILE *fp;
+    explicit OctreeFileSource(FILE *f) : fp(f) {}
+    size_t read(void *p, size_t n) {
+        return fread(p, 1, n, fp);
+    }
+};
+
+struct OctreeIstreamSource {
+    std::istream &is;
+    explicit OctreeIstreamSource(std::istream &i) : is(i) {}
+    size_t read(void *p, size_t n) {
+        is.read((char*)p, (std::streamsize)n);
+        return (size_t)is.gcount();
+    }
+};
+
+
+template <typename Sink>
+class OctreeStreamWriter {
+    enum { BUF_SIZE = 1<<16 };
+
+    Sink &sink;
+    unsigned char buf[BUF_SIZE];
+    size_t used;
+    bool ok;
+
+public:
+    explicit OctreeStreamWriter(Sink &s) : sink(s), used(0), ok(true) {}
+
+    void flush() {
+        if (used && !sink.write(buf, used)) ok = false;
+        used = 0;
+    }
+
+    inline void byte(unsigned char c) {
+        if (used == BUF_SIZE) flush();
+        buf[used++] = c;
+    }
+
+    inline void put(const void *p, size_t n) {
+        const unsigned char *c = (const unsigned char*)p;
+        for (size_t i=0;i<n;i++) byte(c[i]);
+    }
+
+    inline void varint(uint64_t v) {
+        if (used + 10 > BUF_SIZE) flush();
+        while (v >= 0x80) {
+            buf[used++] = (unsigned char)(v | 0x80);
+            v >>= 7;
+        }
+        buf[used++] = (unsigned char)v;
+    }
+
+    bool finish() {
+        flush();
+        return ok;
+    }
+};
+
+template <typename Source>
+class OctreeStreamReader {
+    enum { BUF_SIZE = 1<<16 };
+
+    Source &src;
+    unsigned char buf[BUF_SIZE];
+    size_t pos, len;
+    bool ok;
+
+    bool fill() {
+        pos = 0;
+        len = src.read(buf, BUF_SIZE);
+        if (len == 0) ok = false;
+        return len > 0;
+    }
+
+public:
+    explicit OctreeStreamReader(Source &s) : src(s), pos(0), len(0), ok(true) {}
+
+    bool good() const {
+        return ok;
+    }
+
+    // 0 at the end of the stream (and good() turns false).
+    inline unsigned char byte() {
+        if (pos == len && !fill()) return 0;
+        return buf[pos++];
+    }
+
+    inline void get(void *p, size_t n) {
+        unsigned char *c = (unsigned char*)p;
+        for (size_t i=0;i<n;i++) c[i] = byte();
+    }
+
+    inline uint64_t varint() {
+        uint64_t v = 0;
+        for (int s=0;s<64;s+=7) {
+            unsigned char c = byte();
+            v |= (uint64_t)(c & 0x7f) << s;
+            if (!(c & 0x80)) return v;
+        }
+        ok = false;
+        return 0;
+    }
+};
+
+
+// Value codecs: zigzag varints for integral types, raw bytes otherwise.
+template <typename V, bool INTEGRAL = std::is_integral<V>::value>
+struct OctreeValueCodec {
+    static const int id = OCTREE_CODEC_FIXED;
+    template <typename W>
+    static inline void write(W &w, const V &v) {
+        w.put(&v, sizeof(V));
+    }
+    template <typename R>
+    static inline V read(R &r) {
+        V v;
+        r.get(&v, sizeof(V));
+        return v;
+    }
+};
+
+template <typename V>
+struct OctreeValueCodec<V, true> {
+    static const int id = OCTREE_CODEC_VARINT;
+    template <typename W>
+    static inline void write(W &w, const V &v) {
+        int64_t s = (int64_t)v;
+        w.varint(((uint64_t)s << 1) ^ (uint64_t)(s >> 63));
+    }
+    template <typename R>
+    static inline V read(R &r) {
+        uint64_t u = r.varint();
+        return (V)(int64_t)((u >> 1) ^ (~(u & 1) + 1));
+    }
+};
+
+#endif
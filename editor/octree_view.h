@@ -0,0 +1,224 @@
+#ifndef _OCTREE_VIEW_H
+#define _OCTREE_VIEW_H
+
+#include <vector>
+#include <stdint.h>
+#include "octree_fill.h"
+#include "octree_voxf.h"
+
+inline int voxf_popcount16(uint32_t t) {
+#if defined(__GNUC__)
+    return __builtin_popcount(t);
+#else
+    t = (t & 0x5555) + ((t >> 1) & 0x5555);
+    t = (t & 0x3333) + ((t >> 2) & 0x3333);
+    t = (t + (t >> 4)) & 0x0f0f;
+    return (int)((t + (t >> 8)) & 0x1f);
+#endif
+}
+
+// Number of node and leaf children in the 2 bit child types of a
+// NodeDesc (desc >> 16).
+inline int voxf_count_nodes(uint32_t t) {
+    return voxf_popcount16(t & ~(t >> 1) & 0x5555);
+}
+
+inline int voxf_count_leaves(uint32_t t) {
+    return voxf_popcount16(~t & (t >> 1) & 0x5555);
+}
+
+
+// Read-only octree over a VOXF image, used in place (no node is built).
+// Opening parses only the header and the schema. Child i of a node is
+// found with the nodeRank directory: the counts at the start of the
+// node's block plus the child types of at most VOXF_RANK_BLOCK-1 descs.
+// Files without nodeRank get the directory built once in memory.
+template <typename V>
+class OctreeView {
+    OctreeMappedFile file;
+    OctreeVoxfReader r;
+    std::vector<unsigned char> own_rank;
+    const unsigned char *rank;
+    int depth;
+    long esize;
+
+    OctreeView(const OctreeView&);
+    OctreeView& operator=(const OctreeView&);
+
+    // child types of node n. Referenced subtrees (VOXF_NODE_REF) are not
+    // followed and read as empty.
+    inline uint32_t types(uint32_t n) const {
+        uint32_t d = voxf_u32(r.desc + (size_t)n*4);
+        return (d & 0xff) == VOXF_NODE_NORMAL ? d >> 16 : 0;
+    }
+
+    // Index of the first node child and the first leaf child of node n.
+    inline void first(uint32_t n, uint32_t &node, uint32_t &leaf) const {
+        uint32_t b = n / VOXF_RANK_BLOCK;
+        node = 1 + voxf_u32(rank + (size_t)b*8);
+        leaf = voxf_u32(rank + (size_t)b*8 + 4);
+        for (uint32_t i=b*VOXF_RANK_BLOCK;i<n;i++) {
+            uint32_t t = types(i);
+            node += voxf_count_nodes(t);
+            leaf += voxf_count_leaves(t);
+        }
+    }
+
+    inline V leafValue(uint32_t i) const {
+        return i < r.leaf_num ? r.template leafValue<V>(i) : V();
+    }
+
+    void buildRank() {
+        own_rank.resize((size_t)(r.node_num + VOXF_RANK_BLOCK - 1) / VOXF_RANK_BLOCK * 8);
+        uint32_t cn = 0, cl = 0;
+        for (uint32_t i=0;i<r.node_num;i++) {
+            if (i % VOXF_RANK_BLOCK == 0) {
+                unsigned char *p = &own_rank[(size_t)i / VOXF_RANK_BLOCK * 8];
+                for (int k=0;k<4;k++) {
+                    p[k] = (unsigned char)(cn >> (k*8));
+                    p[k+4] = (unsigned char)(cl >> (k*8));
+                }
+            }
+            uint32_t t = types(i);
+            cn += voxf_count_nodes(t);
+            cl += voxf_count_leaves(t);
+        }
+        rank = &own_rank[0];
+    }
+
+    void slice(uint32_t n, int d, long p, int axis, V *buf, int stride) const {
+        uint32_t t = types(n), node, leaf;
+        first(n, node, leaf);
+        uint32_t ni[8];
+        int type[8];
+        for (int c=0;c<8;c++) {
+            type[c] = (t >> (c*2)) & 3;
+            ni[c] = type[c] == VOXF_CHILD_NODE ? node++ : type[c] == VOXF_CHILD_LEAF ? leaf++ : 0;
+        }
+        int half = 1 << (d-1);
+        int o = ((p >> (d-1)) & 1) << axis;
+        int ub = 1 << ((axis+1)%3);
+        int vb = 1 << ((axis+2)%3);
+        int cs[4] = {o, o|ub, o|vb, o|ub|vb};
+        V *bs[4] = {buf, buf+half, buf+half*stride, buf+half*stride+half};
+        for (int k=0;k<4;k++) {
+            int c = cs[k];
+            if (type[c] == VOXF_CHILD_NODE && d > 1 && ni[c] < r.node_num) {
+                slice(ni[c], d-1, p, axis, bs[k], stride);
+            } else {
+                V v = type[c] == VOXF_CHILD_LEAF ? leafValue(ni[c]) : V();
+                octree_fill(bs[k], half, half, stride, v);
+            }
+        }
+    }
+
+    template <typename F>
+    void forEachLeaf(uint32_t n, long x, long y, long z, int d, F &f) const {
+        uint32_t t = types(n), node, leaf;
+        first(n, node, leaf);
+        long half = 1L << (d-1);
+        for (int c=0;c<8;c++) {
+            long cx = x+half*(c&1), cy = y+half*((c>>1)&1), cz = z+half*((c>>2)&1);
+            switch ((t >> (c*2)) & 3) {
+            case VOXF_CHILD_NODE:
+                if (d > 1 && node < r.node_num) forEachLeaf(node, cx, cy, cz, d-1, f);
+                node++;
+                break;
+            case VOXF_CHILD_LEAF:
+                f(cx, cy, cz, half, leafValue(leaf++));
+                break;
+            }
+        }
+    }
+
+    bool attach(const unsigned char *p, size_t size) {
+        if (!r.parse(p, size) || r.node_num == 0 || r.max_depth < 1 || r.max_depth > 30 || !r.leaf_type) {
+            return false;
+        }
+        depth = r.max_depth;
+        esize = 1L << depth;
+        if (r.rank) {
+            rank = r.rank;
+        } else {
+            buildRank();
+        }
+        return true;
+    }
+
+public:
+    OctreeView() : rank(NULL), depth(0), esize(0) {}
+
+    bool open(const char *path) {
+        close();
+        if (file.open(path) && attach(file.data(), file.size())) return true;
+        close();
+        return false;
+    }
+
+    // p must stay valid until close().
+    bool open(const void *p, size_t size) {
+        close();
+        if (attach((const unsigned char*)p, size)) return true;
+        close();
+        return false;
+    }
+
+    void close() {
+        file.close();
+        r = OctreeVoxfReader();
+        own_rank.clear();
+        rank = NULL;
+        depth = 0;
+        esize = 0;
+    }
+
+    bool isOpen() const {
+        return rank != NULL;
+    }
+
+    int size() const {
+        return (int)esize;
+    }
+
+    V getValue(long x, long y, long z) const {
+        if (x<0 || x>=esize || y<0 || y>=esize || z<0 || z>=esize) return -1;
+        uint32_t n = 0;
+        for (int d=depth-1;d>=0;d--) {
+            int c = (int)(((x >> d) & 1) | (((y >> d) & 1) << 1) | (((z >> d) & 1) << 2));
+            uint32_t t = types(n);
+            uint32_t below = t & ((1u << (c*2)) - 1);
+            uint32_t node, leaf;
+            switch ((t >> (c*2)) & 3) {
+            case VOXF_CHILD_NODE:
+                first(n, node, leaf);
+                n = node + voxf_count_nodes(below);
+                if (d == 0 || n >= r.node_num) return V();
+                break;
+            case VOXF_CHILD_LEAF:
+                first(n, node, leaf);
+                return leafValue(leaf + voxf_count_leaves(below));
+            default:
+                return V();
+            }
+        }
+        return V();
+    }
+
+    // Same as Octree::get_slice.
+    void get_slice(int axis, int p, V *buf, int stride) const {
+        if (p<0 || p>=esize) {
+            octree_fill(buf, (int)esize, (int)esize, stride, V(-1));
+            return;
+        }
+        slice(0, depth, p, axis, buf, stride);
+    }
+
+    // Calls f(x, y, z, size, value) for each leaf cube with a value other
+    // than V(), in depth first order.
+    template <typename F>
+    void forEachLeaf(F f) const {
+        forEachLeaf(0, 0, 0, 0, depth, f);
+    }
+};
+
+#endif
@@ -0,0 +1,716 @@
+#ifndef _OCTREE_VOXF_H
+#define _OCTREE_VOXF_H
+
+#include <cstdio>
+#include <cstring>
+#include <cstdlib>
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include <type_traits>
+
+#ifdef _WIN32
+// no min/max macros in the headers included after this one
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+// VOXF container (docs/voxel_format.md)
+//
+//   "VOXF", version, file size                     (uint32 x 3)
+//   schema size, "JSON", schema                    (padded with spaces)
+//   data size, "BIN\0", NodeDesc[], leaf values, node ranks
+//
+// The draft calls the header 16 bytes but lists 12; the 12 listed are
+// written. Child types are as in its table (0: empty, 1: node, 2: leaf).
+// Nodes and leaves are numbered in breadth first order. All numbers are
+// little endian. Leaves with value V() are written as empty children.
+//
+// Extension: the tree may have "nodeRank": {"accessor": n}, a ui32 pair
+// per VOXF_RANK_BLOCK nodes holding the number of node and leaf children
+// of all nodes before the block. It lets readers find the n-th child
+// without scanning (see OctreeView).
+//
+// A node with nodeType VOXF_NODE_REF (desc: 4 | ref_id << 8) has its
+// subtree in the file externalRefs[ref_id], relative to this file. Its
+// children are not in this file (see OctreePagedStorage).
+
+static const uint32_t VOXF_VERSION = 1;
+static const uint32_t VOXF_RANK_BLOCK = 32;
+
+enum {
+    VOXF_CHILD_EMPTY = 0,
+    VOXF_CHILD_NODE = 1,
+    VOXF_CHILD_LEAF = 2,
+    VOXF_CHILD_UNDEFINED = 3,
+};
+
+enum {
+    VOXF_NODE_NORMAL = 1,
+    VOXF_NODE_REF = 4,
+};
+
+
+// Read only memory mapped file.
+class OctreeMappedFile {
+    const unsigned char *ptr;
+    size_t len;
+#ifdef _WIN32
+    HANDLE file;
+    HANDLE mapping;
+#else
+    int fd;
+#endif
+
+    OctreeMappedFile(const OctreeMappedFile&);
+    OctreeMappedFile& operator=(const OctreeMappedFile&);
+
+public:
+#ifdef _WIN32
+    OctreeMappedFile() : ptr(NULL), len(0), file(INVALID_HANDLE_VALUE), mapping(NULL) {}
+#else
+    OctreeMappedFile() : ptr(NULL), len(0), fd(-1) {}
+#endif
+    ~OctreeMappedFile() {
+        close();
+    }
+
+    bool open(const char *path) {
+        close();
+#ifdef _WIN32
+        file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+        if (file == INVALID_HANDLE_VALUE) return false;
+        LARGE_INTEGER sz;
+        if (!GetFileSizeEx(file, &sz) || sz.QuadPart == 0) {
+            close();
+            return false;
+        }
+        mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+        if (mapping == NULL) {
+            close();
+            return false;
+        }
+        ptr = (const unsigned char*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+        if (ptr == NULL) {
+            close();
+            return false;
+        }
+        len = (size_t)sz.QuadPart;
+#else
+        fd = ::open(path, O_RDONLY);
+        if (fd < 0) return false;
+        struct stat st;
+        if (fstat(fd, &st) != 0 || st.st_size == 0) {
+            close();
+            return false;
+        }
+        void *p = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (p == MAP_FAILED) {
+            close();
+            return false;
+        }
+        ptr = (const unsigned char*)p;
+        len = (size_t)st.st_size;
+        madvise(p, len, MADV_SEQUENTIAL);
+#endif
+        return true;
+    }
+
+    void close() {
+#ifdef _WIN32
+        if (ptr) UnmapViewOfFile(ptr);
+        if (mapping) CloseHandle(mapping);
+        if (file != INVALID_HANDLE_VALUE) CloseHandle(file);
+        mapping = NULL;
+        file = INVALID_HANDLE_VALUE;
+#else
+        if (ptr) munmap((void*)ptr, len);
+        if (fd >= 0) ::close(fd);
+        fd = -1;
+#endif
+        ptr = NULL;
+        len = 0;
+    }
+
+    const unsigned char *data() const {
+        return ptr;
+    }
+
+    size_t size() const {
+        return len;
+    }
+};
+
+
+// Minimal JSON reader for the schema.
+struct OctreeJson {
+    enum { NUL, BOOL, NUM, STR, ARR, OBJ };
+
+    int type;
+    double num;
+    std::string str;
+    std::vector<std::string> keys;
+    std::vector<OctreeJson> items;
+
+    OctreeJson() : type(NUL), num(0) {}
+
+    const OctreeJson *get(const char *key) const {
+        for (size_t i=0;i<keys.size();i++) {
+            if (keys[i] == key) return &items[i];
+        }
+        return NULL;
+    }
+
+    const OctreeJson *at(long i) const {
+        return type == ARR && i >= 0 && (size_t)i < items.size() ? &items[i] : NULL;
+    }
+
+    double getNum(const char *key, double def) const {
+        const OctreeJson *v = get(key);
+        return v && v->type == NUM ? v->num : def;
+    }
+
+    static void skip(const char *&p, const char *e) {
+        while (p < e && (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n')) p++;
+    }
+
+    static bool parseString(const char *&p, const char *e, std::string &s) {
+        if (p >= e || *p != '"') return false;
+        for (p++;p < e && *p != '"';p++) {
+            if (*p == '\\') {
+                if (++p >= e) return false;
+                switch (*p) {
+                case 'n': s += '\n'; break;
+                case 't': s += '\t'; break;
+                case 'r': s += '\r'; break;
+                case 'b': s += '\b'; break;
+                case 'f': s += '\f'; break;
+                case 'u': // not needed for schemas; kept as '?'
+                    if (e - p < 5) return false;
+                    p += 4;
+                    s += '?';
+                    break;
+                default: s += *p; break;
+                }
+            } else {
+                s += *p;
+            }
+        }
+        if (p >= e) return false;
+        p++;
+        return true;
+    }
+
+    bool parse(const char *&p, const char *e, int nest = 0) {
+        if (nest > 64) return false;
+        skip(p, e);
+        if (p >= e) return false;
+        if (*p == '{' || *p == '[') {
+            bool obj = *p == '{';
+            type = obj ? OBJ : ARR;
+            char close = obj ? '}' : ']';
+            p++;
+            skip(p, e);
+            if (p < e && *p == close) {
+                p++;
+                return true;
+            }
+            for (;;) {
+                skip(p, e);
+                if (obj) {
+                    std::string k;
+                    if (!parseString(p, e, k)) return false;
+                    skip(p, e);
+                    if (p >= e || *p != ':') return false;
+                    p++;
+                    keys.push_back(k);
+                }
+                items.push_back(OctreeJson());
+                if (!items.back().parse(p, e, nest+1)) return false;
+                skip(p, e);
+                if (p >= e) return false;
+                if (*p == ',') {
+                    p++;
+                } else if (*p == close) {
+                    p++;
+                    return true;
+                } else {
+                    return false;
+                }
+            }
+        }
+        if (*p == '"') {
+            type = STR;
+            return parseString(p, e, str);
+        }
+        if (e - p >= 4 && strncmp(p, "true", 4) == 0) {
+            type = BOOL; num = 1; p += 4;
+            return true;
+        }
+        if (e - p >= 5 && strncmp(p, "false", 5) == 0) {
+            type = BOOL; num = 0; p += 5;
+            return true;
+        }
+        if (e - p >= 4 && strncmp(p, "null", 4) == 0) {
+            type = NUL; p += 4;
+            return true;
+        }
+        char buf[64];
+        size_t n = 0;
+        while (p+n < e && n < sizeof(buf)-1 && p[n] && strchr("+-.0123456789eE", p[n])) n++;
+        if (n == 0) return false;
+        memcpy(buf, p, n);
+        buf[n] = 0;
+        type = NUM;
+        num = strtod(buf, NULL);
+        p += n;
+        return true;
+    }
+};
+
+
+// componentType of leaf values.
+struct OctreeVoxfComponent {
+    const char *name;
+    int size;
+    bool is_signed;
+    bool is_float;
+};
+
+static const OctreeVoxfComponent VOXF_COMPONENTS[] = {
+    {"i8", 1, true, false}, {"ui8", 1, false, false},
+    {"i16", 2, true, false}, {"ui16", 2, false, false},
+    {"i32", 4, true, false}, {"ui32", 4, false, false},
+    {"i64", 8, true, false}, {"ui64", 8, false, false},
+    {"f32", 4, true, true}, {"f64", 8, true, true},
+};
+
+template <typename V>
+inline const OctreeVoxfComponent *voxf_component() {
+    for (size_t i=0;i<sizeof(VOXF_COMPONENTS)/sizeof(VOXF_COMPONENTS[0]);i++) {
+        const OctreeVoxfComponent &c = VOXF_COMPONENTS[i];
+        if (c.size == (int)sizeof(V) && c.is_float == std::is_floating_point<V>::value &&
+                (c.is_float || c.is_signed == std::is_signed<V>::value)) {
+            return &c;
+        }
+    }
+    return NULL;
+}
+
+inline const OctreeVoxfComponent *voxf_component(const std::string &name) {
+    for (size_t i=0;i<sizeof(VOXF_COMPONENTS)/sizeof(VOXF_COMPONENTS[0]);i++) {
+        if (name == VOXF_COMPONENTS[i].name) return &VOXF_COMPONENTS[i];
+    }
+    return NULL;
+}
+
+inline uint32_t voxf_u32(const unsigned char *p) {
+    return p[0] | (p[1]<<8) | (p[2]<<16) | ((uint32_t)p[3]<<24);
+}
+
+inline uint64_t voxf_le(const unsigned char *p, int n) {
+    uint64_t v = 0;
+    for (int i=n-1;i>=0;i--) {
+        v = (v<<8) | p[i];
+    }
+    return v;
+}
+
+
+// Header, schema and array locations of a VOXF image.
+struct OctreeVoxfReader {
+    int max_depth;
+    const unsigned char *desc;
+    uint32_t node_num;
+    const unsigned char *leaf;
+    uint32_t leaf_num;
+    const OctreeVoxfComponent *leaf_type;
+    const unsigned char *rank;  // NULL if the file has no nodeRank
+    uint32_t rank_num;
+    std::vector<std::string> refs;
+
+    OctreeVoxfReader() : max_depth(-1), desc(NULL), node_num(0), leaf(NULL), leaf_num(0), leaf_type(NULL), rank(NULL), rank_num(0) {}
+
+    // p: an accessor. Returns its data (count*elem bytes inside the BIN chunk).
+    static const unsigned char *array(const OctreeJson *a, const unsigned char *bin, size_t bin_size, size_t elem, uint32_t &count) {
+        if (!a || a->type != OctreeJson::OBJ) return NULL;
+        double off = a->getNum("byteOffset", 0), cnt = a->getNum("count", -1);
+        if (a->getNum("buffer", 0) != 0 || off < 0 || cnt < 0) return NULL;
+        if (off + cnt*elem > (double)bin_size) return NULL;
+        count = (uint32_t)cnt;
+        return bin + (size_t)off;
+    }
+
+    bool parse(const unsigned char *p, size_t size) {
+        if (size < 20 || memcmp(p, "VOXF", 4) != 0) return false;
+        if (voxf_u32(p+4) != VOXF_VERSION || voxf_u32(p+8) > size) return false;
+        size = voxf_u32(p+8);
+
+        size_t json_size = voxf_u32(p+12);
+        if (memcmp(p+16, "JSON", 4) != 0 || 20 + json_size + 8 > size) return false;
+        const char *js = (const char*)p+20;
+        OctreeJson schema;
+        if (!schema.parse(js, js+json_size) || schema.type != OctreeJson::OBJ) return false;
+
+        const unsigned char *bin = p+20+json_size;
+        size_t bin_size = voxf_u32(bin);
+        if (memcmp(bin+4, "BIN", 4) != 0 || bin_size > size-(20+json_size+8)) return false;
+        bin += 8;
+
+        max_depth = (int)schema.getNum("maxDepth", -1);
+        const OctreeJson *trees = schema.get("trees"), *acc = schema.get("accessors");
+        const OctreeJson *tree = trees ? trees->at(0) : NULL;
+        if (!tree || !acc || tree->getNum("branchingFactor", 8) != 8) return false;
+        const OctreeJson *nd = tree->get("nodeDesc");
+        if (!nd || nd->getNum("type", 0) != 0) return false;
+        desc = array(acc->at((long)nd->getNum("accessor", -1)), bin, bin_size, 4, node_num);
+        if (!desc) return false;
+        const OctreeJson *nr = tree->get("nodeRank");
+        if (nr) {
+            rank = array(acc->at((long)nr->getNum("accessor", -1)), bin, bin_size, 4, rank_num);
+            if (!rank || rank_num != (node_num + VOXF_RANK_BLOCK - 1) / VOXF_RANK_BLOCK * 2) return false;
+        }
+
+        const OctreeJson *er = schema.get("externalRefs");
+        for (long i=0;er && er->at(i);i++) {
+            if (er->at(i)->type != OctreeJson::STR) return false;
+            refs.push_back(er->at(i)->str);
+        }
+
+        // leaf values: first attribute of the leaf primitive
+        const OctreeJson *prims = schema.get("primitives");
+        const OctreeJson *lp = prims ? prims->at((long)tree->getNum("leafNodePrimitive", -1)) : NULL;
+        const OctreeJson *attr = lp ? lp->get("attributes") : NULL;
+        if (attr && attr->type == OctreeJson::OBJ && !attr->items.empty()) {
+            const OctreeJson *a = acc->at((long)attr->items[0].num);
+            const OctreeJson *ct = a ? a->get("componentType") : NULL;
+            leaf_type = ct ? voxf_component(ct->str) : NULL;
+            if (!leaf_type) return false;
+            leaf = array(a, bin, bin_size, leaf_type->size, leaf_num);
+            if (!leaf) return false;
+        }
+        return true;
+    }
+
+    template <typename V>
+    V leafValue(uint32_t i) const {
+        const unsigned char *p = leaf + (size_t)i * leaf_type->size;
+        uint64_t bits = voxf_le(p, leaf_type->size);
+        if (leaf_type->is_float) {
+            if (leaf_type->size == 4) {
+                uint32_t b = (uint32_t)bits;
+                float f;
+                memcpy(&f, &b, 4);
+                return (V)f;
+            }
+            double d;
+            memcpy(&d, &bits, 8);
+            return (V)d;
+        }
+        if (leaf_type->is_signed && leaf_type->size < 8) {
+            int sh = 64 - leaf_type->size*8;
+            return (V)((int64_t)(bits << sh) >> sh);
+        }
+        return (V)(int64_t)bits;
+    }
+};
+
+
+// Buffered little endian file writer.
+class OctreeVoxfWriter {
+    enum { BUF_SIZE = 1<<16 };
+
+    FILE *fp;
+    unsigned char buf[BUF_SIZE];
+    size_t used;
+    bool ok;
+
+    OctreeVoxfWriter(const OctreeVoxfWriter&);
+    OctreeVoxfWriter& operator=(const OctreeVoxfWriter&);
+
+public:
+    explicit OctreeVoxfWriter(const char *path) : used(0), ok(true) {
+        fp = fopen(path, "wb");
+    }
+    ~OctreeVoxfWriter() {
+        close();
+    }
+
+    bool isOpen() const {
+        return fp != NULL;
+    }
+
+    void flush() {
+        if (fp && used && fwrite(buf, 1, used, fp) != used) ok = false;
+        used = 0;
+    }
+
+    inline void put(const void *p, size_t n) {
+        if (used + n > BUF_SIZE) {
+            flush();
+            if (n > BUF_SIZE) {
+                if (fp && fwrite(p, 1, n, fp) != n) ok = false;
+                return;
+            }
+        }
+        memcpy(buf + used, p, n);
+        used += n;
+    }
+
+    inline void u32(uint32_t v) {
+        unsigned char b[4] = {(unsigned char)v, (unsigned char)(v>>8), (unsigned char)(v>>16), (unsigned char)(v>>24)};
+        put(b, 4);
+    }
+
+    void zero(size_t n) {
+        static const unsigned char z[8] = {0};
+        for (;n>0;n-=(n<8?n:8)) put(z, n<8?n:8);
+    }
+
+    template <typename V>
+    void value(const V &v) {
+        uint64_t bits = 0;
+        if (sizeof(V) == 4 && std::is_floating_point<V>::value) {
+            float f = (float)v;
+            uint32_t b;
+            memcpy(&b, &f, 4);
+            bits = b;
+        } else if (std::is_floating_point<V>::value) {
+            double d = (double)v;
+            memcpy(&bits, &d, 8);
+        } else {
+            bits = (uint64_t)(int64_t)v;
+        }
+        unsigned char b[8];
+        for (size_t i=0;i<sizeof(V);i++) {
+            b[i] = (unsigned char)(bits >> (i*8));
+        }
+        put(b, sizeof(V));
+    }
+
+    bool close() {
+        if (!fp) return false;
+        flush();
+        if (fclose(fp) != 0) ok = false;
+        fp = NULL;
+        return ok;
+    }
+};
+
+// Schema for one tree. Returns it padded so the BIN chunk data is 8 byte
+// aligned. leaf_offset, rank_offset: byte offsets of the leaf values and
+// the nodeRank pairs in the BIN chunk. refs: externalRefs or NULL.
+inline std::string voxf_schema(int depth, uint32_t node_num, uint32_t leaf_num, const char *type, int type_size,
+        size_t &leaf_offset, size_t &rank_offset, size_t &bin_size, const std::vector<std::string> *refs = NULL) {
+    uint32_t rank_num = (node_num + VOXF_RANK_BLOCK - 1) / VOXF_RANK_BLOCK * 2;
+    leaf_offset = ((size_t)node_num*4 + 7) & ~(size_t)7;
+    rank_offset = (leaf_offset + (size_t)leaf_num*type_size + 3) & ~(size_t)3;
+    bin_size = rank_offset + (size_t)rank_num*4;
+    char s[1024];
+    snprintf(s, sizeof(s),
+        "{\"maxDepth\":%d,"
+        "\"buffers\":[{\"byteLength\":%lu}],"
+        "\"accessors\":["
+            "{\"buffer\":0,\"byteOffset\":0,\"componentType\":\"ui32\",\"count\":%lu,\"type\":\"SCALAR\",\"name\":\"nodeDesc\"},"
+            "{\"buffer\":0,\"byteOffset\":%lu,\"componentType\":\"%s\",\"count\":%lu,\"type\":\"SCALAR\",\"name\":\"leafData\"},"
+            "{\"buffer\":0,\"byteOffset\":%lu,\"componentType\":\"ui32\",\"count\":%lu,\"type\":\"SCALAR\",\"name\":\"nodeRank\"}],"
+        "\"primitives\":[{},{\"attributes\":{\"VALUE\":1}}],"
+        "\"trees\":[{\"branchingFactor\":8,\"nodeDesc\":{\"type\":0,\"accessor\":0},\"nodeRank\":{\"accessor\":2},\"primitive\":0,\"leafNodePrimitive\":1}]",
+        depth, (unsigned long)bin_size, (unsigned long)node_num, (unsigned long)leaf_offset, type, (unsigned long)leaf_num,
+        (unsigned long)rank_offset, (unsigned long)rank_num);
+    std::string json(s);
+    if (refs && !refs->empty()) {
+        json += ",\"externalRefs\":[";
+        for (size_t i=0;i<refs->size();i++) {
+            json += i ? ",\"" : "\"";
+            json += (*refs)[i];
+            json += '"';
+        }
+        json += ']';
+    }
+    json += '}';
+    while ((20 + json.size()) % 8) json += ' ';
+    return json;
+}
+
+
+// Ref callbacks of voxf_write/voxf_read for trees without references.
+struct OctreeVoxfNoRef {
+    template <typename N>
+    long operator()(N) const {
+        return -1;
+    }
+    template <typename N>
+    bool operator()(N, uint32_t) const {
+        return false;
+    }
+};
+
+// Writes the subtree at root of storage s (see OctreeNodeStorage), depth
+// levels deep. ref(n) returns the ref_id for a node written as
+// VOXF_NODE_REF or -1. refs are the names for externalRefs.
+// A single leaf is written as a root node with 8 leaves.
+template <typename V, typename S, typename Ref>
+bool voxf_write(const S &s, typename S::Node root, int depth, const char *path, const Ref &ref,
+        const std::vector<std::string> *refs = NULL) {
+    typedef typename S::Node Node;
+    const OctreeVoxfComponent *type = voxf_component<V>();
+    if (!type) return false;
+
+    // nodes with children in breadth first order and their NodeDesc.
+    bool flat = !s.hasChild(root);
+    std::vector<Node> nodes(1, root);
+    std::vector<uint32_t> descs;
+    uint32_t leaf_num = 0;
+    for (size_t i=0;i<nodes.size();i++) {
+        long id = i ? ref(nodes[i]) : -1;
+        if (id >= 0) {
+            descs.push_back(VOXF_NODE_REF | (uint32_t)id << 8);
+            continue;
+        }
+        uint32_t desc = VOXF_NODE_NORMAL;
+        for (int c=0;c<8;c++) {
+            uint32_t t;
+            if (flat) {
+                t = s.value(root) != V() ? VOXF_CHILD_LEAF : VOXF_CHILD_EMPTY;
+            } else {
+                Node n = s.child(nodes[i], c);
+                if (s.hasChild(n)) {
+                    nodes.push_back(n);
+                    t = VOXF_CHILD_NODE;
+                } else {
+                    t = s.value(n) != V() ? VOXF_CHILD_LEAF : VOXF_CHILD_EMPTY;
+                }
+            }
+            if (t == VOXF_CHILD_LEAF) leaf_num++;
+            desc |= t << (16 + c*2);
+        }
+        descs.push_back(desc);
+    }
+
+    size_t leaf_offset, rank_offset, bin_size;
+    std::string json = voxf_schema(depth, (uint32_t)nodes.size(), leaf_num, type->name, type->size, leaf_offset, rank_offset, bin_size, refs);
+    OctreeVoxfWriter w(path);
+    if (!w.isOpen()) return false;
+    w.put("VOXF", 4);
+    w.u32(VOXF_VERSION);
+    w.u32((uint32_t)(20 + json.size() + 8 + bin_size));
+    w.u32((uint32_t)json.size());
+    w.put("JSON", 4);
+    w.put(json.data(), json.size());
+    w.u32((uint32_t)bin_size);
+    w.put("BIN", 4);
+
+    for (size_t i=0;i<descs.size();i++) {
+        w.u32(descs[i]);
+    }
+    w.zero(leaf_offset - nodes.size()*4);
+    for (size_t i=0;i<nodes.size();i++) {
+        if ((descs[i] & 0xff) != VOXF_NODE_NORMAL) continue;
+        for (int c=0;c<8;c++) {
+            if (((descs[i] >> (16 + c*2)) & 3) != VOXF_CHILD_LEAF) continue;
+            w.value(flat ? s.value(root) : s.value(s.child(nodes[i], c)));
+        }
+    }
+    w.zero(rank_offset - leaf_offset - (size_t)leaf_num*type->size);
+    uint32_t rn = 0, rl = 0;
+    for (size_t i=0;i<descs.size();i++) {
+        if (i % VOXF_RANK_BLOCK == 0) {
+            w.u32(rn);
+            w.u32(rl);
+        }
+        if ((descs[i] & 0xff) != VOXF_NODE_NORMAL) continue;
+        for (int c=0;c<8;c++) {
+            uint32_t t = (descs[i] >> (16 + c*2)) & 3;
+            if (t == VOXF_CHILD_NODE) rn++;
+            if (t == VOXF_CHILD_LEAF) rl++;
+        }
+    }
+    return w.close();
+}
+
+// Builds the subtree at root from a parsed file of the same depth, in one
+// pass over the NodeDesc array. ref(n, ref_id) attaches a VOXF_NODE_REF
+// node. Returns false if the depth differs; on other errors root is left
+// empty.
+template <typename V, typename S, typename Ref>
+bool voxf_read(S &s, typename S::Node root, int depth, const OctreeVoxfReader &r, const Ref &ref) {
+    typedef typename S::Node Node;
+    if (r.max_depth != depth || r.node_num == 0) return false;
+    s.collapse(root, V());
+
+    std::vector<Node> queue;
+    queue.reserve(r.node_num);
+    queue.push_back(root);
+    uint32_t leaf = 0;
+    size_t level_end = 1;
+    int level = 0;
+    for (uint32_t i=0;i<r.node_num;i++) {
+        if (i == level_end) {
+            level++;
+            level_end = queue.size();
+        }
+        uint32_t desc = voxf_u32(r.desc + (size_t)i*4);
+        if (i >= queue.size() || level >= depth) {
+            s.collapse(root, V());
+            return false;
+        }
+        Node n = queue[i];
+        if ((desc & 0xff) == VOXF_NODE_REF && level > 0) {
+            if (!ref(n, desc >> 8)) {
+                s.collapse(root, V());
+                return false;
+            }
+            continue;
+        }
+        if ((desc & 0xff) != VOXF_NODE_NORMAL) {
+            s.collapse(root, V());
+            return false;
+        }
+        s.split(n);
+        for (int c=0;c<8;c++) {
+            Node ch = s.mutableChild(n, c);
+            switch ((desc >> (16 + c*2)) & 3) {
+            case VOXF_CHILD_NODE:
+                queue.push_back(ch);
+                break;
+            case VOXF_CHILD_LEAF:
+                if (leaf >= r.leaf_num) {
+                    s.collapse(root, V());
+                    return false;
+                }
+                s.collapse(ch, r.template leafValue<V>(leaf++));
+                break;
+            default:
+                s.collapse(ch, V());
+                break;
+            }
+        }
+    }
+    if (queue.size() != r.node_num) {
+        s.collapse(root, V());
+        return false;
+    }
+
+    // a single leaf was written as 8 leaves
+    if (!s.hasChild(root)) return true;
+    V v = s.value(s.child(root, 0));
+    for (int c=0;c<8;c++) {
+        Node ch = s.child(root, c);
+        if (s.hasChild(ch) || s.value(ch) != v) return true;
+    }
+    s.collapse(root, v);
+    return true;
+}
+
+#endif